@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// The 8-bit adds and subtracts, INC/DEC and DAA as table loads, the tables worked out at
+// compile time. Entries for the adds, subtracts and DAA are what AF becomes: the result in the
+// upper byte and the flags (Z N H C in bits 7-4) in the lower.
+//
+// The adds and subtracts are indexed by their raw 9-bit result and the carry into bit 4
+// rather than by (A, operand, carry), which would take 128K entries each.
+struct Alu
+{
+    static constexpr std::uint8_t zero = 1 << 7;
+    static constexpr std::uint8_t subtraction = 1 << 6;
+    static constexpr std::uint8_t half_carry = 1 << 5;
+    static constexpr std::uint8_t carry = 1 << 4;
+
+    // Into add and subtract: result is a + operand + carry in or a - operand - carry in.
+    // Bit 8 of the result is then the carry or borrow out, and bit 4 of a ^ operand ^ result
+    // the one into bit 4.
+    static constexpr std::size_t index(int a, int operand, int result)
+    {
+        return (result & 0x1FF) | ((a ^ operand ^ result) & 0x10) << 5;
+    }
+
+    // Into decimal_adjust, straight from AF: N, H and C pick one of eight rows of 256.
+    static constexpr std::size_t decimal_adjust_index(std::uint16_t accumulator_and_flags)
+    {
+        return (accumulator_and_flags & (subtraction | half_carry | carry)) << 4 | accumulator_and_flags >> 8;
+    }
+
+    // ADD and ADC
+    static constexpr std::array<std::uint16_t, 0x400> add = []
+    {
+        std::array<std::uint16_t, 0x400> table{};
+        for (std::size_t i = 0; i < table.size(); ++i)
+        {
+            const std::size_t result = i & 0xFF;
+            table[i] = static_cast<std::uint16_t>(result << 8 | (result == 0 ? zero : 0) | (i & 0x200 ? half_carry : 0) | (i & 0x100 ? carry : 0));
+        }
+        return table;
+    }();
+
+    // SUB, SBC and, keeping A, CP
+    static constexpr std::array<std::uint16_t, 0x400> subtract = []
+    {
+        std::array<std::uint16_t, 0x400> table{};
+        for (std::size_t i = 0; i < table.size(); ++i)
+            table[i] = add[i] | subtraction;
+        return table;
+    }();
+
+    // After an add DAA corrects each digit above 9, or that carried, by 6; after a subtract
+    // it takes back 6 from the digits that borrowed. N stays, H clears.
+    static constexpr std::array<std::uint16_t, 0x800> decimal_adjust = []
+    {
+        std::array<std::uint16_t, 0x800> table{};
+        for (std::size_t i = 0; i < table.size(); ++i)
+        {
+            const std::uint8_t flags = static_cast<std::uint8_t>(i >> 4 & 0x70);
+            const int a = i & 0xFF;
+            int adjust = 0;
+            bool carry_out = (flags & carry) != 0;
+            if (flags & subtraction)
+            {
+                adjust -= flags & half_carry ? 0x06 : 0;
+                adjust -= carry_out ? 0x60 : 0;
+            }
+            else
+            {
+                if ((flags & half_carry) || (a & 0xF) > 0x9)
+                    adjust += 0x06;
+                if (carry_out || a > 0x99)
+                {
+                    adjust += 0x60;
+                    carry_out = true;
+                }
+            }
+            const int result = (a + adjust) & 0xFF;
+            table[i] = static_cast<std::uint16_t>(result << 8 | (result == 0 ? zero : 0) | (flags & subtraction) | (carry_out ? carry : 0));
+        }
+        return table;
+    }();
+
+    // Z, N and H of INC and DEC by the value before; they leave C alone.
+    static constexpr std::array<std::uint8_t, 256> increment_flags = []
+    {
+        std::array<std::uint8_t, 256> table{};
+        for (int value = 0; value < 256; ++value)
+        {
+            const int result = (value + 1) & 0xFF;
+            table[value] = static_cast<std::uint8_t>((result == 0 ? zero : 0) | ((result & 0xF) == 0 ? half_carry : 0));
+        }
+        return table;
+    }();
+
+    static constexpr std::array<std::uint8_t, 256> decrement_flags = []
+    {
+        std::array<std::uint8_t, 256> table{};
+        for (int value = 0; value < 256; ++value)
+        {
+            const int result = (value - 1) & 0xFF;
+            table[value] = static_cast<std::uint8_t>((result == 0 ? zero : 0) | subtraction | ((result & 0xF) == 0xF ? half_carry : 0));
+        }
+        return table;
+    }();
+};
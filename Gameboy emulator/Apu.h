@@ -0,0 +1,441 @@
+#pragma once
+
+#include "Blip_buffer.h"
+#include "Scheduler.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+struct Apu_channel
+{
+    bool enabled = false;
+    std::uint16_t length{};
+    std::uint8_t volume{};
+    std::uint8_t envelope_timer{};
+    std::uint8_t position{};
+    std::uint16_t lfsr = 0x7FFF;
+    std::uint64_t next_edge = Scheduler::never;
+    std::uint8_t output{};
+};
+
+// Four-channel APU. Nothing is ticked per cycle: each channel is advanced edge by edge up to
+// the current time whenever a register is touched, the frame sequencer fires, or a sample
+// batch ends. Without an Audio_output (muted) the register and length/envelope/sweep
+// behaviour is unchanged and the edges are counted rather than walked, but no samples are made.
+struct Apu
+{
+    static constexpr std::uint16_t first_register = 0xFF10;
+    static constexpr std::uint16_t wave_ram_start = 0xFF30;
+    static constexpr std::uint16_t last_address = 0xFF3F;
+    static constexpr std::uint64_t frame_sequencer_period = 8192;
+    static constexpr std::uint64_t batch_period = 70224;
+    static constexpr std::int32_t amplitude_scale = 32;
+
+    static constexpr std::array<std::uint8_t, 32> read_masks
+    {
+        0x80, 0x3F, 0x00, 0xFF, 0xBF,
+        0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+        0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+        0xFF, 0xFF, 0x00, 0x00, 0xBF,
+        0x00, 0x00, 0x70,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    static constexpr std::array<std::uint8_t, 4> duty_patterns{ 0b00000001, 0b10000001, 0b10000111, 0b01111110 };
+
+    enum Register
+    {
+        NR10 = 0x00, NR11, NR12, NR13, NR14,
+        NR21 = 0x06, NR22, NR23, NR24,
+        NR30 = 0x0A, NR31, NR32, NR33, NR34,
+        NR41 = 0x10, NR42, NR43, NR44,
+        NR50 = 0x14, NR51, NR52
+    };
+
+    std::array<std::uint8_t, 32> registers{};
+    std::array<std::uint8_t, 16> wave_ram{};
+    std::array<Apu_channel, 4> channels{};
+    bool powered = true;
+    std::uint8_t frame_step{};
+    std::uint16_t sweep_shadow{};
+    std::uint8_t sweep_timer{};
+    bool sweep_enabled = false;
+
+    void start(std::uint64_t now, Scheduler& scheduler)
+    {
+        registers[NR50] = 0x77;
+        registers[NR51] = 0xF3;
+        scheduler.schedule(Event::apu_frame_sequencer, now + frame_sequencer_period);
+        scheduler.schedule(Event::apu_end_batch, now + batch_period);
+    }
+
+    std::uint8_t read(std::uint16_t address, std::uint64_t now, Audio_output* audio)
+    {
+        if (address >= wave_ram_start)
+            return wave_ram[address - wave_ram_start];
+
+        const auto index = address - first_register;
+        if (index == NR52)
+        {
+            run_until(now, audio);
+            std::uint8_t status = powered ? 0xF0 : 0x70;
+            for (std::size_t c = 0; c < channels.size(); ++c)
+                if (channels[c].enabled)
+                    status |= 1 << c;
+            return status;
+        }
+        return registers[index] | read_masks[index];
+    }
+
+    void write(std::uint16_t address, std::uint8_t value, std::uint64_t now, Audio_output* audio)
+    {
+        run_until(now, audio);
+        if (address >= wave_ram_start)
+        {
+            wave_ram[address - wave_ram_start] = value;
+            return;
+        }
+
+        const auto index = address - first_register;
+        if (index == NR52)
+        {
+            set_power((value & 0x80) != 0, now, audio);
+            return;
+        }
+        if (!powered || index > NR52)
+            return;
+
+        if (index == NR50 || index == NR51)
+        {
+            const auto left_before = mix(true);
+            const auto right_before = mix(false);
+            registers[index] = value;
+            add_delta(audio, now, mix(true) - left_before, mix(false) - right_before);
+            return;
+        }
+
+        registers[index] = value;
+        const auto channel = index / 5;
+        switch (index % 5)
+        {
+            case 1:
+            {
+                channels[channel].length = channel == 2 ? 256 - value : 64 - (value & 0x3F);
+                break;
+            }
+            case 2:
+            {
+                if (!dac_enabled(channel))
+                    disable(channel, now, audio);
+                break;
+            }
+            case 4:
+            {
+                if ((value & 0x80) != 0)
+                    trigger(channel, now, audio);
+                break;
+            }
+            default:
+            {
+                if (index == NR30 && !dac_enabled(2))
+                    disable(2, now, audio);
+                break;
+            }
+        }
+    }
+
+    void frame_sequencer(std::uint64_t at, Scheduler& scheduler, Audio_output* audio)
+    {
+        scheduler.schedule(Event::apu_frame_sequencer, at + frame_sequencer_period);
+        if (!powered)
+            return;
+        run_until(at, audio);
+
+        if ((frame_step & 1) == 0)
+            for (std::size_t c = 0; c < channels.size(); ++c)
+                clock_length(c, at, audio);
+        if (frame_step == 2 || frame_step == 6)
+            clock_sweep(at, audio);
+        if (frame_step == 7)
+            for (const std::size_t c : { 0, 1, 3 })
+                clock_envelope(c, at, audio);
+
+        frame_step = (frame_step + 1) & 7;
+    }
+
+    void end_batch(std::uint64_t at, Scheduler& scheduler, Audio_output* audio)
+    {
+        scheduler.schedule(Event::apu_end_batch, at + batch_period);
+        run_until(at, audio);
+        if (audio)
+            audio->end_batch(at);
+    }
+
+    void run_until(std::uint64_t now, Audio_output* audio)
+    {
+        for (std::size_t c = 0; c < channels.size(); ++c)
+        {
+            auto& channel = channels[c];
+            if (!audio)
+            {
+                // The same edges as below, so the duty/wave position and the noise LFSR end
+                // where they would have with audio on.
+                if (channel.next_edge <= now)
+                {
+                    const auto edge_period = period(c);
+                    const auto edges = (now - channel.next_edge) / edge_period + 1;
+                    channel.next_edge += edges * edge_period;
+                    if (c == 3)
+                        for (std::uint64_t i = 0; i < edges; ++i)
+                            advance(c);
+                    else
+                        channel.position = static_cast<std::uint8_t>((channel.position + edges) & (c == 2 ? 31 : 7));
+                    update_output(c, now, nullptr);
+                }
+                continue;
+            }
+            while (channel.next_edge <= now)
+            {
+                const auto edge = channel.next_edge;
+                advance(c);
+                channel.next_edge += period(c);
+                update_output(c, edge, audio);
+            }
+        }
+    }
+
+    // After a muted stretch the synthesis side restarts from the current levels.
+    void resume_output(std::uint64_t now, Audio_output& audio)
+    {
+        run_until(now, nullptr);
+        audio.batch_start = now;
+    }
+
+private:
+    std::uint16_t frequency(std::size_t channel) const
+    {
+        return static_cast<std::uint16_t>(((registers[channel * 5 + 4] & 7) << 8) | registers[channel * 5 + 3]);
+    }
+
+    void set_frequency(std::size_t channel, std::uint16_t value)
+    {
+        registers[channel * 5 + 3] = value & 0xFF;
+        registers[channel * 5 + 4] = static_cast<std::uint8_t>((registers[channel * 5 + 4] & 0xF8) | (value >> 8));
+    }
+
+    std::uint64_t period(std::size_t channel) const
+    {
+        switch (channel)
+        {
+            case 0:
+            case 1:
+                return (2048 - frequency(channel)) * 4;
+            case 2:
+                return (2048 - frequency(channel)) * 2;
+            default:
+            {
+                const auto divisor_code = registers[NR43] & 7;
+                const std::uint64_t divisor = divisor_code == 0 ? 8 : divisor_code * 16;
+                return divisor << (registers[NR43] >> 4);
+            }
+        }
+    }
+
+    bool dac_enabled(std::size_t channel) const
+    {
+        if (channel == 2)
+            return (registers[NR30] & 0x80) != 0;
+        return (registers[channel * 5 + 2] & 0xF8) != 0;
+    }
+
+    void advance(std::size_t channel)
+    {
+        auto& state = channels[channel];
+        switch (channel)
+        {
+            case 0:
+            case 1:
+                state.position = (state.position + 1) & 7;
+                break;
+            case 2:
+                state.position = (state.position + 1) & 31;
+                break;
+            default:
+            {
+                const std::uint16_t feedback = (state.lfsr ^ (state.lfsr >> 1)) & 1;
+                state.lfsr = static_cast<std::uint16_t>((state.lfsr >> 1) | (feedback << 14));
+                if ((registers[NR43] & 0x08) != 0)
+                    state.lfsr = static_cast<std::uint16_t>((state.lfsr & ~(1 << 6)) | (feedback << 6));
+                break;
+            }
+        }
+    }
+
+    std::uint8_t level(std::size_t channel) const
+    {
+        const auto& state = channels[channel];
+        if (!state.enabled)
+            return 0;
+        switch (channel)
+        {
+            case 0:
+            case 1:
+            {
+                const auto duty = duty_patterns[registers[channel * 5 + 1] >> 6];
+                return ((duty >> (7 - state.position)) & 1) != 0 ? state.volume : 0;
+            }
+            case 2:
+            {
+                const auto packed = wave_ram[state.position / 2];
+                const auto sample = (state.position & 1) != 0 ? packed & 0xF : packed >> 4;
+                const auto volume_code = (registers[NR32] >> 5) & 3;
+                return volume_code == 0 ? 0 : static_cast<std::uint8_t>(sample >> (volume_code - 1));
+            }
+            default:
+                return (state.lfsr & 1) == 0 ? state.volume : 0;
+        }
+    }
+
+    std::int32_t mix(bool left) const
+    {
+        const auto volume = (left ? (registers[NR50] >> 4) & 7 : registers[NR50] & 7) + 1;
+        std::int32_t total = 0;
+        for (std::size_t c = 0; c < channels.size(); ++c)
+            if ((registers[NR51] & (1 << (c + (left ? 4 : 0)))) != 0)
+                total += channels[c].output;
+        return total * volume * amplitude_scale;
+    }
+
+    void add_delta(Audio_output* audio, std::uint64_t time, std::int32_t left, std::int32_t right)
+    {
+        if (!audio)
+            return;
+        const auto offset = time > audio->batch_start ? time - audio->batch_start : 0;
+        if (left != 0)
+            audio->left.add_delta(offset, left);
+        if (right != 0)
+            audio->right.add_delta(offset, right);
+    }
+
+    void update_output(std::size_t channel, std::uint64_t time, Audio_output* audio)
+    {
+        const auto new_level = level(channel);
+        const auto delta = static_cast<std::int32_t>(new_level) - channels[channel].output;
+        if (delta == 0)
+            return;
+        channels[channel].output = new_level;
+        if (!audio)
+            return;
+        const auto left = (registers[NR51] & (1 << (channel + 4))) != 0 ? delta * (((registers[NR50] >> 4) & 7) + 1) * amplitude_scale : 0;
+        const auto right = (registers[NR51] & (1 << channel)) != 0 ? delta * ((registers[NR50] & 7) + 1) * amplitude_scale : 0;
+        add_delta(audio, time, left, right);
+    }
+
+    void disable(std::size_t channel, std::uint64_t now, Audio_output* audio)
+    {
+        channels[channel].enabled = false;
+        channels[channel].next_edge = Scheduler::never;
+        update_output(channel, now, audio);
+    }
+
+    void trigger(std::size_t channel, std::uint64_t now, Audio_output* audio)
+    {
+        auto& state = channels[channel];
+        state.enabled = dac_enabled(channel);
+        if (state.length == 0)
+            state.length = channel == 2 ? 256 : 64;
+        state.next_edge = state.enabled ? now + period(channel) : Scheduler::never;
+
+        if (channel == 2)
+            state.position = 0;
+        else
+        {
+            const auto envelope = registers[channel * 5 + 2];
+            state.volume = envelope >> 4;
+            state.envelope_timer = (envelope & 7) != 0 ? envelope & 7 : 8;
+        }
+        if (channel == 3)
+            state.lfsr = 0x7FFF;
+        if (channel == 0)
+        {
+            const auto sweep_period = (registers[NR10] >> 4) & 7;
+            const auto sweep_shift = registers[NR10] & 7;
+            sweep_shadow = frequency(0);
+            sweep_timer = sweep_period != 0 ? sweep_period : 8;
+            sweep_enabled = sweep_period != 0 || sweep_shift != 0;
+            if (sweep_shift != 0)
+                sweep_calculate(now, audio);
+        }
+        update_output(channel, now, audio);
+    }
+
+    void clock_length(std::size_t channel, std::uint64_t now, Audio_output* audio)
+    {
+        auto& state = channels[channel];
+        if ((registers[channel * 5 + 4] & 0x40) == 0 || state.length == 0)
+            return;
+        if (--state.length == 0)
+            disable(channel, now, audio);
+    }
+
+    void clock_envelope(std::size_t channel, std::uint64_t now, Audio_output* audio)
+    {
+        auto& state = channels[channel];
+        const auto envelope = registers[channel * 5 + 2];
+        if ((envelope & 7) == 0 || --state.envelope_timer != 0)
+            return;
+        state.envelope_timer = envelope & 7;
+        if ((envelope & 0x08) != 0 && state.volume < 15)
+            ++state.volume;
+        else if ((envelope & 0x08) == 0 && state.volume > 0)
+            --state.volume;
+        update_output(channel, now, audio);
+    }
+
+    std::uint16_t sweep_calculate(std::uint64_t now, Audio_output* audio)
+    {
+        const auto change = sweep_shadow >> (registers[NR10] & 7);
+        const auto result = (registers[NR10] & 0x08) != 0 ? sweep_shadow - change : sweep_shadow + change;
+        if (result > 2047)
+            disable(0, now, audio);
+        return static_cast<std::uint16_t>(result);
+    }
+
+    void clock_sweep(std::uint64_t now, Audio_output* audio)
+    {
+        if (--sweep_timer != 0)
+            return;
+        const auto sweep_period = (registers[NR10] >> 4) & 7;
+        sweep_timer = sweep_period != 0 ? sweep_period : 8;
+        if (!sweep_enabled || sweep_period == 0 || !channels[0].enabled)
+            return;
+
+        const auto result = sweep_calculate(now, audio);
+        if (result <= 2047 && (registers[NR10] & 7) != 0)
+        {
+            sweep_shadow = result;
+            set_frequency(0, result);
+            sweep_calculate(now, audio);
+        }
+    }
+
+    void set_power(bool on, std::uint64_t now, Audio_output* audio)
+    {
+        if (on == powered)
+            return;
+        if (!on)
+        {
+            for (std::size_t c = 0; c < channels.size(); ++c)
+                disable(c, now, audio);
+            const auto left_before = mix(true);
+            const auto right_before = mix(false);
+            registers.fill(0);
+            add_delta(audio, now, mix(true) - left_before, mix(false) - right_before);
+            for (auto& channel : channels)
+                channel.length = 0;
+        }
+        else
+            frame_step = 0;
+        powered = on;
+    }
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Cpu_state.h"
+#include "Profile.h"
+#include "Thread_pool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Runs many independent instances on a persistent thread pool. Each instance keeps its own
+// profile so the hot path never touches shared counters; merging happens after the join.
+struct Batch_runner
+{
+    std::vector<std::unique_ptr<Cpu_state>> instances;
+    std::vector<Profile> profiles;
+    Thread_pool pool;
+
+    explicit Batch_runner(unsigned thread_count = std::thread::hardware_concurrency())
+        : pool{ thread_count }
+    {
+    }
+
+    Cpu_state& add_instance()
+    {
+        instances.push_back(std::make_unique<Cpu_state>());
+        if (profiling)
+        {
+            profiles.emplace_back();
+            attach_profiles();
+        }
+        return *instances.back();
+    }
+
+    // Starts every profile over. Instances added later get one too.
+    void enable_profiling()
+    {
+        profiling = true;
+        profiles.assign(instances.size(), Profile{});
+        attach_profiles();
+    }
+
+    void run_for(std::uint64_t cycle_count)
+    {
+        pool.parallel_for(instances.size(), [&](std::size_t i) { instances[i]->run_for(cycle_count); });
+    }
+
+    // actions[i] is the button state for instance i during the step. then(i, instance) runs on
+    // the same worker once the instance has finished its frames.
+    template <typename Then>
+    void step(const std::uint8_t* actions, std::uint64_t frame_count, Then then)
+    {
+        pool.parallel_for(instances.size(), [&](std::size_t i)
+        {
+            instances[i]->set_input(actions[i]);
+            instances[i]->run_frames(frame_count);
+            then(i, *instances[i]);
+        });
+    }
+
+    void step(const std::uint8_t* actions, std::uint64_t frame_count)
+    {
+        step(actions, frame_count, [](std::size_t, Cpu_state&) {});
+    }
+
+    Profile merged_profile() const
+    {
+        Profile merged;
+        for (const auto& profile : profiles)
+            merged.merge(profile);
+        return merged;
+    }
+
+private:
+    bool profiling = false;
+
+    // Growing profiles may move them, so every instance is pointed at its own again.
+    void attach_profiles()
+    {
+        for (std::size_t i = 0; i < instances.size(); ++i)
+            instances[i]->attach_profile(&profiles[i]);
+    }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Band-limited step synthesis in the style of blip_buf. Amplitude changes are added as
+// deltas at their exact clock time, spread over a short windowed-sinc kernel at the output
+// rate, and integrated only when samples are read. Resampling from the 4 MiHz clock to the
+// output rate falls out of the placement, so there is no separate resampling pass.
+struct Blip_buffer
+{
+    static constexpr std::uint64_t clock_rate = 4194304;
+    static constexpr std::uint64_t sample_rate = 48000;
+    static constexpr int kernel_width = 16;
+    static constexpr int phase_bits = 5;
+    static constexpr int phase_count = 1 << phase_bits;
+    static constexpr int time_bits = 20;
+    static constexpr int delta_bits = 15;
+    static constexpr int bass_shift = 9;
+    static constexpr std::size_t capacity = 4096;
+    static constexpr std::uint64_t factor = (sample_rate << time_bits) / clock_rate;
+
+    using Kernel = std::array<std::array<std::int32_t, kernel_width>, phase_count>;
+
+    std::array<std::int32_t, capacity + kernel_width> deltas{};
+    std::uint64_t offset{};
+    std::int32_t integrator{};
+
+    // clock_time is relative to the start of the current batch
+    void add_delta(std::uint64_t clock_time, std::int32_t delta)
+    {
+        const auto fixed = clock_time * factor + offset;
+        const auto index = std::min<std::size_t>(fixed >> time_bits, capacity - 1);
+        const auto& phase = step_kernel()[(fixed >> (time_bits - phase_bits)) & (phase_count - 1)];
+        std::int32_t* out = &deltas[index];
+        for (int i = 0; i < kernel_width; ++i)
+            out[i] += phase[i] * delta;
+    }
+
+    void end_batch(std::uint64_t clock_duration)
+    {
+        offset += clock_duration * factor;
+    }
+
+    std::size_t samples_available() const
+    {
+        return std::min<std::size_t>(offset >> time_bits, capacity);
+    }
+
+    // Writes count samples to every stride-th element of out and drops them from the buffer.
+    void read_samples(std::int16_t* out, std::size_t count, std::size_t stride)
+    {
+        count = std::min(count, samples_available());
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            integrator += deltas[i];
+            const auto sample = std::clamp(integrator >> delta_bits, -32768, 32767);
+            out[i * stride] = static_cast<std::int16_t>(sample);
+            integrator -= sample << (delta_bits - bass_shift);
+        }
+        std::copy(deltas.begin() + count, deltas.end(), deltas.begin());
+        std::fill(deltas.end() - count, deltas.end(), 0);
+        offset -= static_cast<std::uint64_t>(count) << time_bits;
+    }
+
+    static const Kernel& step_kernel()
+    {
+        static const Kernel kernel = []
+        {
+            constexpr double pi = 3.14159265358979323846;
+            constexpr double cutoff = 0.9;
+            Kernel table{};
+            for (int phase = 0; phase < phase_count; ++phase)
+            {
+                std::array<double, kernel_width> taps{};
+                double sum = 0;
+                for (int i = 0; i < kernel_width; ++i)
+                {
+                    const double x = i - (kernel_width / 2 - 1) - static_cast<double>(phase) / phase_count;
+                    const double sinc = x == 0 ? 1.0 : std::sin(pi * x * cutoff) / (pi * x * cutoff);
+                    const double window = 0.5 + 0.5 * std::cos(pi * x / (kernel_width / 2));
+                    taps[i] = sinc * window;
+                    sum += taps[i];
+                }
+                std::int32_t total = 0;
+                for (int i = 0; i < kernel_width; ++i)
+                {
+                    table[phase][i] = static_cast<std::int32_t>(std::lround(taps[i] / sum * (1 << delta_bits)));
+                    total += table[phase][i];
+                }
+                table[phase][kernel_width / 2 - 1] += (1 << delta_bits) - total;
+            }
+            return table;
+        }();
+        return kernel;
+    }
+};
+
+// Synthesis side of the APU: not part of the machine state, and absent entirely in muted runs.
+struct Audio_output
+{
+    static constexpr std::size_t max_buffered_samples = Blip_buffer::sample_rate; // one second, stereo frames
+
+    Blip_buffer left;
+    Blip_buffer right;
+    std::uint64_t batch_start{};
+    std::vector<std::int16_t> samples; // interleaved left/right
+
+    void end_batch(std::uint64_t now)
+    {
+        left.end_batch(now - batch_start);
+        right.end_batch(now - batch_start);
+        batch_start = now;
+
+        const auto count = std::min(left.samples_available(), right.samples_available());
+        if (count == 0)
+            return;
+        const auto previous_size = samples.size();
+        samples.resize(previous_size + count * 2);
+        left.read_samples(&samples[previous_size], count, 2);
+        right.read_samples(&samples[previous_size + 1], count, 2);
+
+        if (samples.size() > max_buffered_samples * 2)
+            samples.erase(samples.begin(), samples.end() - max_buffered_samples * 2);
+    }
+
+    // Moves up to max_frames stereo frames into out; returns the number of frames written.
+    std::size_t take_samples(std::int16_t* out, std::size_t max_frames)
+    {
+        const auto frames = std::min(max_frames, samples.size() / 2);
+        std::copy(samples.begin(), samples.begin() + frames * 2, out);
+        samples.erase(samples.begin(), samples.begin() + frames * 2);
+        return frames;
+    }
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+struct Cpu_state;
+
+// One basic block of a ROM translated to C++ by tools/rom_recompiler. It runs the block's
+// instructions from its first one, stopping early wherever the interpreter would have done
+// something before the next fetch, and leaves the program counter where it stopped.
+struct Compiled_block
+{
+    using Function = void (*)(Cpu_state&);
+
+    std::uint16_t start{};
+    std::uint16_t end{};  // one past its last byte
+    Function run{};
+};
+
+// The blocks compiled from one ROM, to be attached to instances running that ROM.
+struct Compiled_rom
+{
+    std::uint64_t rom_hash{};  // of 0x0000-0x7FFF as loaded, see hash()
+    std::span<const Compiled_block> blocks;  // by start address
+
+    // FNV-1a, over the fixed 32 KiB the cartridge maps; a shorter ROM counts as zero-padded.
+    static constexpr std::uint64_t hash(std::span<const std::uint8_t> rom)
+    {
+        std::uint64_t value = 0xCBF29CE484222325;
+        for (std::size_t i = 0; i < 0x8000; ++i)
+            value = (value ^ (i < rom.size() ? rom[i] : 0)) * 0x100000001B3;
+        return value;
+    }
+};
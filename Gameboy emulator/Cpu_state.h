@@ -1,7 +1,37 @@
+#pragma once
+
+#include "Alu.h"
+#include "Apu.h"
+#include "Blip_buffer.h"
+#include "Compiled_rom.h"
+#include "Debugger.h"
+#include "Dma.h"
+#include "Frame_pipeline.h"
+#include "Interrupts.h"
+#include "Joypad.h"
+#include "Link_port.h"
 #include "opcode.h"
-
+#include "Ppu.h"
+#include "Profile.h"
+#include "Render_thread.h"
+#include "Scheduler.h"
+#include "Serial.h"
+#include "Sprite_lists.h"
+#include "Tile_cache.h"
+#include "Timer.h"
+#include "Watch_list.h"
+
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <chrono>
 #include <cstdint>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 enum class Flags
 {
@@ -19,15 +49,687 @@ struct Registers
     std::uint16_t HL{};
     std::uint16_t stack_pointer{};
     std::uint16_t program_counter{};
+
+    bool operator==(const Registers&) const = default;
+};
+
+// What the CPU looked like at the head of the last backward JR NZ/JR Z it took. Seeing the
+// same registers there again, one iteration later and with no event in between, means the
+// loop is spinning on values that cannot change before the next event.
+struct Idle_loop
+{
+    std::uint16_t head{};
+    std::uint16_t branch{};
+    std::uint32_t period{};  // cycles per iteration, 0 if the body is not a pure polling loop
+    std::uint64_t cycles{};
+    std::uint64_t cycle_target{};
+    Registers registers;
 };
 
+// Everything that makes up the emulated machine, as one trivially copyable block. Host-side
+// state (audio synthesis, frame buffers, debugger, profiler, page pointers) is not included.
+struct Savestate
+{
+    Registers registers;
+    std::array<std::uint8_t, 65536> memory;
+    std::array<std::uint8_t, 0x2000> vram_bank1;
+    std::array<std::array<std::uint8_t, 0x1000>, 6> wram_banks;
+    bool cgb;
+    std::uint8_t vram_bank;
+    std::uint8_t wram_bank;
+    std::uint8_t speed_shift;
+    bool speed_switch_prepared;
+    std::uint64_t cycles;
+    std::uint64_t frame_count;
+    Scheduler scheduler;
+    Interrupts interrupts;
+    Joypad joypad;
+    Timer timer;
+    Ppu ppu;
+    Dma dma;
+    Serial serial;
+    Apu apu;
+};
+
+static_assert(std::is_trivially_copyable_v<Savestate>);
+
 struct Cpu_state
 {
 
 public:
     Registers registers;
     static constexpr size_t memory_size = 65536;
-    std::array<std::uint8_t, memory_size> memory;
+    static constexpr size_t page_count = 256;
+    static constexpr std::uint16_t KEY1 = 0xFF4D;
+    static constexpr std::uint16_t VBK = 0xFF4F;
+    static constexpr std::uint16_t SVBK = 0xFF70;
+    static constexpr std::uint64_t speed_switch_dots = 8200;
+    std::array<std::uint8_t, memory_size> memory{};
+    // CGB-only memory; bank 0 of VRAM and banks 0-1 of WRAM stay in memory
+    std::array<std::uint8_t, 0x2000> vram_bank1{};
+    std::array<std::array<std::uint8_t, 0x1000>, 6> wram_banks{};
+    bool cgb = false;
+    std::uint8_t vram_bank{};
+    std::uint8_t wram_bank = 1;
+    std::uint8_t speed_shift{};  // 1 in CGB double speed: the CPU takes half the dots
+    bool speed_switch_prepared = false;
+    std::uint64_t cycles{};
+    std::uint64_t cycle_target{};
+    std::uint64_t run_end{};
+    Scheduler scheduler;
+    Interrupts interrupts;
+    Joypad joypad;
+    Timer timer;
+    Ppu ppu;
+    Tile_cache tile_cache;
+    Sprite_lists sprite_lists;
+    Frame_pipeline frames;
+    std::unique_ptr<Render_thread> render_thread;  // set while lines are drawn on their own thread
+    std::uint64_t frame_count{};
+    std::uint64_t stop_frame = Scheduler::never;
+    bool turbo = false;
+    std::uint32_t render_interval = 1;
+    bool render_frame = true;  // whether the frame in progress is drawn
+    bool draw_frames = true;
+    std::uint32_t run_ahead{};
+    std::unique_ptr<Savestate> run_ahead_state;
+    bool speculative = false;  // running frames that run-ahead throws away
+    Dma dma;
+    Serial serial;
+    Watch_list watch_list;
+    Apu apu;
+    Audio_output audio;
+    bool audio_muted = false;
+    Profile* profile{};
+    Debugger* debugger{};
+    Link_port* link{};
+    const Compiled_rom* compiled_rom{};
+    std::vector<Compiled_block::Function> compiled_blocks;  // by start address; null where a block's bytes have changed
+    std::vector<std::uint8_t> compiled_image;  // the ROM the blocks were compiled from
+    std::uint16_t longest_compiled_block{};
+    std::ostream* serial_output{};  // gets every byte sent with nothing connected
+    bool skip_idle_loops = true;
+    Idle_loop idle_loop;
+    static constexpr std::uint16_t max_idle_loop_bytes = 16;
+
+    // What each page is backed by, whatever the bus currently maps over it.
+    Page_table pages{};
+
+    // A null page sends the access to slow_read/slow_write, which handle I/O, profiling and
+    // watchpoints. Everything else is a direct load or store.
+    Page_table read_pages{};
+    Page_table write_pages{};
+
+    // Unused opcode with no handler and no cycles; returned by the fetch when a breakpoint hits.
+    static constexpr std::uint8_t breakpoint_trap = 0xd3;
+
+    Cpu_state()
+    {
+        map_memory();
+        map_pages();
+        ppu.reset_palettes(cgb);
+        ppu.start(cycles, scheduler);
+        apu.start(cycles, scheduler);
+        scheduler.schedule(Event::apu_frame_sequencer, timer.next_falling_edge(cycles, timer.frame_sequencer_bit()));
+    }
+
+    Cpu_state(const Cpu_state&) = delete;
+    Cpu_state& operator=(const Cpu_state&) = delete;
+
+    void attach_profile(Profile* profile_)
+    {
+        profile = profile_;
+        map_pages();
+    }
+
+    void attach_debugger(Debugger* debugger_)
+    {
+        debugger = debugger_;
+        map_pages();
+    }
+
+    // Runs the ROM's basic blocks as compiled ahead of time wherever their bytes are still the
+    // ones they were compiled from, and interprets everything else. Returns false, attaching
+    // nothing, if the ROM loaded is not the one compiled. Profiling still interprets everything.
+    bool attach_compiled_rom(const Compiled_rom* compiled)
+    {
+        compiled_rom = nullptr;
+        compiled_blocks.clear();
+        compiled_image.clear();
+        const bool matches = !compiled || compiled->rom_hash == Compiled_rom::hash({ memory.data(), 0x8000 });
+        if (compiled && matches)
+        {
+            compiled_rom = compiled;
+            compiled_image.assign(memory.begin(), memory.begin() + 0x8000);
+            compiled_blocks.assign(0x8000, nullptr);
+            longest_compiled_block = 0;
+            for (const auto& block : compiled->blocks)
+                longest_compiled_block = std::max<std::uint16_t>(longest_compiled_block, block.end - block.start);
+            validate_compiled_blocks(0, 0x8000);
+        }
+        map_pages();
+        return matches;
+    }
+
+    // Enables the blocks overlapping [first, last) whose bytes match the image, and disables
+    // the others.
+    void validate_compiled_blocks(std::uint32_t first, std::uint32_t last)
+    {
+        const auto blocks = compiled_rom->blocks;
+        auto block = std::lower_bound(blocks.begin(), blocks.end(), first - std::min<std::uint32_t>(first, longest_compiled_block),
+            [](const Compiled_block& block, std::uint32_t address) { return block.start < address; });
+        for (; block != blocks.end() && block->start < last; ++block)
+            if (block->end > first)
+                compiled_blocks[block->start] = std::equal(&memory[block->start], &memory[block->end], &compiled_image[block->start]) ? block->run : nullptr;
+    }
+
+    // Plugs in one end of a link cable; link time starts now. Ports connected in-process are
+    // run through Link_cable.
+    void attach_link(Link_port* link_)
+    {
+        link = link_;
+        scheduler.cancel(Event::link_sync);
+        if (link)
+        {
+            link->base = cycles;
+            link->peer_time = 0;
+            if (link->remote())
+                scheduler.schedule(Event::link_sync, cycles + link->sync_interval);
+        }
+    }
+
+    // Copies the fixed 32 KiB of the cartridge into place and sets up what the boot ROM leaves behind.
+    void load_rom(const std::uint8_t* data, std::size_t size)
+    {
+        std::copy_n(data, std::min<std::size_t>(size, 0x8000), memory.begin());
+        cgb = size > 0x143 && (data[0x143] & 0x80) != 0;
+        ppu.reset_palettes(cgb);
+        if (render_thread)
+            restart_render_thread();
+        registers.accumulator_and_flags = cgb ? 0x1180 : 0x01B0;
+        registers.BC = cgb ? 0x0000 : 0x0013;
+        registers.DE = cgb ? 0xFF56 : 0x00D8;
+        registers.HL = cgb ? 0x000D : 0x014D;
+        registers.stack_pointer = 0xFFFE;
+        registers.program_counter = 0x100;
+        if (compiled_rom)
+            validate_compiled_blocks(0, 0x8000);
+    }
+
+    void save_state(Savestate& state) const
+    {
+        state.registers = registers;
+        state.memory = memory;
+        state.vram_bank1 = vram_bank1;
+        state.wram_banks = wram_banks;
+        state.cgb = cgb;
+        state.vram_bank = vram_bank;
+        state.wram_bank = wram_bank;
+        state.speed_shift = speed_shift;
+        state.speed_switch_prepared = speed_switch_prepared;
+        state.cycles = cycles;
+        state.frame_count = frame_count;
+        state.scheduler = scheduler;
+        state.interrupts = interrupts;
+        state.joypad = joypad;
+        state.timer = timer;
+        state.ppu = ppu;
+        state.dma = dma;
+        state.serial = serial;
+        state.apu = apu;
+    }
+
+    // Only between runs: the current run_for, if any, ends.
+    void load_state(const Savestate& state)
+    {
+        restore_state(state);
+        apu.resume_output(cycles, audio);
+    }
+
+    // load_state without touching audio output, for going back to a state saved moments ago
+    // in the same audio batch. Only the tiles and sprite lists that differ are rebuilt.
+    void restore_state(const Savestate& state)
+    {
+        tile_cache.invalidate_changed(0, &memory[0x8000], &state.memory[0x8000]);
+        tile_cache.invalidate_changed(1, vram_bank1.data(), state.vram_bank1.data());
+        if (!std::equal(&memory[Dma::oam_start], &memory[Dma::oam_start + Dma::oam_size], &state.memory[Dma::oam_start]))
+            sprite_lists.dirty = true;
+        registers = state.registers;
+        memory = state.memory;
+        vram_bank1 = state.vram_bank1;
+        wram_banks = state.wram_banks;
+        cgb = state.cgb;
+        vram_bank = state.vram_bank;
+        wram_bank = state.wram_bank;
+        speed_shift = state.speed_shift;
+        speed_switch_prepared = state.speed_switch_prepared;
+        cycles = state.cycles;
+        frame_count = state.frame_count;
+        scheduler = state.scheduler;
+        interrupts = state.interrupts;
+        joypad = state.joypad;
+        timer = state.timer;
+        ppu = state.ppu;
+        dma = state.dma;
+        serial = state.serial;
+        apu = state.apu;
+        idle_loop = {};
+        stop();
+        map_memory();
+        map_pages();
+        if (compiled_rom)
+            validate_compiled_blocks(0, 0x8000);
+        if (render_thread)
+            restart_render_thread();
+    }
+
+    void set_input(std::uint8_t buttons)
+    {
+        if (joypad.set_buttons(buttons))
+            interrupts.request(Interrupts::joypad);
+    }
+
+    // Runs until count more frames have been published. With the LCD off no frame ever
+    // completes, so it gives up after count + 1 frames' worth of cycles.
+    void run_frames(std::uint64_t count)
+    {
+        // Frames run ahead would reach the other end of a link cable
+        if (run_ahead != 0 && !link)
+            run_frames_ahead(count);
+        else
+            run_whole_frames(count);
+        if (render_thread)
+            render_thread->finish();
+    }
+
+    // Run-ahead hides frames of the game's own input lag: run_frames runs its frames without
+    // drawing them, saves the state, runs frames more silently, shows the last of those and
+    // goes back to the saved state. The state lives in a buffer made here, so running ahead
+    // allocates nothing.
+    void set_run_ahead(std::uint32_t frames)
+    {
+        run_ahead = frames;
+        if (run_ahead != 0 && !run_ahead_state)
+            run_ahead_state = std::make_unique<Savestate>();
+    }
+
+    void run_whole_frames(std::uint64_t count)
+    {
+        stop_frame = frame_count + count;
+        run_for((count + 1) * Ppu::frame_dots);
+        stop_frame = Scheduler::never;
+    }
+
+    void run_frames_ahead(std::uint64_t count)
+    {
+        draw_frames = false;
+        render_frame = false;
+        run_whole_frames(count);
+        save_state(*run_ahead_state);
+
+        const bool muted = audio_muted;
+        audio_muted = true;
+        speculative = true;
+        if (run_ahead > 1)
+            run_whole_frames(run_ahead - 1);
+        draw_frames = true;
+        render_frame = true;
+        run_whole_frames(1);
+        if (render_thread)
+            render_thread->finish();
+        restore_state(*run_ahead_state);
+        speculative = false;
+        audio_muted = muted;
+        render_frame = (frame_count + 1) % render_interval == 0;
+    }
+
+    // Draws lines on a thread of their own, fed by a log of the CPU's video writes. Frames come
+    // out identical; run_frames waits for the last one, run_for does not.
+    void set_threaded_rendering(bool enabled)
+    {
+        if (enabled == (render_thread != nullptr))
+            return;
+        if (enabled)
+        {
+            render_thread = std::make_unique<Render_thread>(frames);
+            restart_render_thread();
+        }
+        else
+        {
+            render_thread->finish();
+            ppu.window_line = render_thread->window_line();
+            render_thread.reset();
+            tile_cache.invalidate_all();
+            sprite_lists.dirty = true;
+        }
+        map_pages();
+    }
+
+    // Hands the render thread a fresh copy of the video state, once it has caught up.
+    void restart_render_thread()
+    {
+        render_thread->finish();
+        render_thread->reset(ppu, vram_bank_view(0), vram_bank_view(1), &memory[Dma::oam_start]);
+    }
+
+    // Live views of the instance's RAM. Cpu_state never moves, so they stay valid for its
+    // lifetime and reading a variable needs neither a copy nor a bus access.
+    std::span<std::uint8_t, 0x2000> wram()  // banks 0 and 1: all of it on DMG
+    {
+        return std::span<std::uint8_t, 0x2000>{ &memory[0xC000], 0x2000 };
+    }
+
+    std::span<std::uint8_t, 0x1000> wram_bank_view(std::uint8_t bank)
+    {
+        if (bank >= 2)
+            return wram_banks[(bank - 2) % wram_banks.size()];
+        return std::span<std::uint8_t, 0x1000>{ &memory[bank == 0 ? 0xC000 : 0xD000], 0x1000 };
+    }
+
+    std::span<std::uint8_t, 0x7F> hram()
+    {
+        return std::span<std::uint8_t, 0x7F>{ &memory[0xFF80], 0x7F };
+    }
+
+    std::span<std::uint8_t, 0x2000> cartridge_ram()
+    {
+        return std::span<std::uint8_t, 0x2000>{ &memory[0xA000], 0x2000 };
+    }
+
+    // Read-only: VRAM writes have to go through the bus to keep tile_cache current.
+    std::span<const std::uint8_t, 0x2000> vram_bank_view(std::uint8_t bank) const
+    {
+        if (bank == 1)
+            return vram_bank1;
+        return std::span<const std::uint8_t, 0x2000>{ &memory[0x8000], 0x2000 };
+    }
+
+    // Bank switches only repoint pages; nothing is copied.
+    void map_memory()
+    {
+        for (std::size_t page = 0; page < page_count; ++page)
+            pages[page] = &memory[page << 8];
+        if (vram_bank == 1)
+            for (std::size_t page = 0; page < 0x20; ++page)
+                pages[0x80 + page] = &vram_bank1[page << 8];
+        if (wram_bank > 1)
+            for (std::size_t page = 0; page < 0x10; ++page)
+                pages[0xD0 + page] = &wram_banks[wram_bank - 2][page << 8];
+        // Echo RAM
+        for (std::size_t page = 0; page < 0x1E; ++page)
+            pages[0xE0 + page] = pages[0xC0 + page];
+    }
+
+    void map_pages()
+    {
+        read_pages = pages;
+        write_pages = pages;
+        // I/O registers and HRAM
+        read_pages[0xFF] = nullptr;
+        write_pages[0xFF] = nullptr;
+        // Tile data, so that writes reach the tile cache, and the tile maps too if they are logged
+        for (std::size_t page = 0x80; page < (render_thread ? 0xA0 : 0x98); ++page)
+            write_pages[page] = nullptr;
+        // OAM, so that writes rebuild the sprite lists
+        write_pages[Dma::oam_start >> 8] = nullptr;
+        // ROM, so that writes to it retire the compiled blocks they change
+        if (compiled_rom)
+            std::fill_n(write_pages.begin(), 0x80, nullptr);
+
+        // During OAM DMA everything outside page 0xFF goes through the bus-conflict check
+        if (profile || dma.oam_active)
+        {
+            read_pages.fill(nullptr);
+            write_pages.fill(nullptr);
+        }
+        if (debugger)
+        {
+            for (std::size_t page = 0; page < page_count; ++page)
+            {
+                if (debugger->breakpoint_on_page(page) || debugger->watchpoint_on_page(page, Access::read))
+                    read_pages[page] = nullptr;
+                if (debugger->watchpoint_on_page(page, Access::write))
+                    write_pages[page] = nullptr;
+            }
+            debugger->pages_dirty = false;
+        }
+    }
+
+    void step()
+    {
+        if (interrupts.pending && service_interrupts())
+            return;
+        execute();
+    }
+
+    // step() that runs the compiled block starting at the program counter, if there is one.
+    void compiled_step()
+    {
+        if (interrupts.pending && service_interrupts())
+            return;
+        const auto address = registers.program_counter;
+        if (address < 0x8000 && compiled_blocks[address] && compiled_may_run(address))
+            compiled_blocks[address](*this);
+        else
+            execute();
+    }
+
+    // Whether compiled code may go on to the instruction at address: only where the
+    // interpreter would fetch it next without anything in between, from pages read directly
+    // (not during OAM DMA, nor under a breakpoint or read watchpoint).
+    bool compiled_may_run(std::uint16_t address) const
+    {
+        return cycles < cycle_target && !interrupts.pending && read_pages[address >> 8] && read_pages[(address + 2) >> 8];
+    }
+
+    void execute()
+    {
+        const auto instruction = fetch_instruction();
+        cycles += opcode_cycles[instruction] >> speed_shift;
+        run(opcode{ instruction });
+    }
+
+    // Runs before the fetch whenever interrupts.pending is set. Returns true if it used
+    // up the step (dispatch, HALT, or the HALT bug's repeated fetch).
+    bool service_interrupts()
+    {
+        if (interrupts.enable_delay)
+        {
+            interrupts.enable_delay = false;
+            interrupts.master = true;
+            interrupts.update();
+            return false;
+        }
+
+        const auto requested = interrupts.requested();
+        if (interrupts.halted)
+        {
+            // Only a scheduled event can raise IF while halted, so skip straight to it.
+            if (requested == 0)
+            {
+                cycles = std::max(cycle_target, cycles + (4 >> speed_shift));
+                return true;
+            }
+            interrupts.halted = false;
+            cycles += 4 >> speed_shift;
+        }
+
+        if (interrupts.master && requested != 0)
+        {
+            const auto bit = std::countr_zero(requested);
+            interrupts.flags &= ~(1 << bit);
+            interrupts.master = false;
+            interrupts.update();
+            push_to_stack(registers.program_counter);
+            registers.program_counter = Interrupts::first_vector + bit * 8;
+            cycles += 20 >> speed_shift;
+            return true;
+        }
+
+        if (interrupts.halt_bug)
+        {
+            // HALT with IME clear and an interrupt already pending: the next byte is fetched twice.
+            interrupts.halt_bug = false;
+            interrupts.update();
+            const auto instruction = fetch_instruction();
+            --registers.program_counter;
+            cycles += opcode_cycles[instruction] >> speed_shift;
+            run(opcode{ instruction });
+            return true;
+        }
+
+        interrupts.update();
+        return false;
+    }
+
+    void run_for(std::uint64_t cycle_count)
+    {
+        run_end = cycles + cycle_count;
+        if (debugger)
+        {
+            if (debugger->pages_dirty)
+                map_pages();
+            if (registers.program_counter != debugger->stop_address)
+                debugger->resuming = false;
+            debugger->stop_reason = Stop_reason::none;
+        }
+
+        while (cycles < run_end)
+        {
+            cycle_target = std::min(run_end, scheduler.next_deadline);
+            if (profile)
+            {
+                while (cycles < cycle_target)
+                    profiled_step();
+            }
+            else if (compiled_rom)
+            {
+                while (cycles < cycle_target)
+                    compiled_step();
+            }
+            else
+            {
+                while (cycles < cycle_target)
+                    step();
+            }
+            dispatch_events();
+        }
+    }
+
+    // Ends the current run_for after the instruction in flight.
+    void stop()
+    {
+        run_end = cycles;
+        cycle_target = cycles;
+    }
+
+    void dispatch_events()
+    {
+        Event event;
+        std::uint64_t at;
+        while (scheduler.pop_due(cycles, event, at))
+        {
+            switch (event)
+            {
+                case Event::apu_frame_sequencer:
+                    apu.frame_sequencer(at, scheduler, audio_output());
+                    break;
+                case Event::apu_end_batch:
+                    apu.end_batch(at, scheduler, audio_output());
+                    break;
+                case Event::ppu_mode:
+                    switch (ppu.advance(at, scheduler, interrupts))
+                    {
+                        case Ppu::hblank:
+                        {
+                            if (render_frame && render_thread)
+                                render_thread->render_line(ppu.ly, at);
+                            else if (render_frame)
+                            {
+                                Frame& frame = frames.back_buffer();
+                                const auto line = ppu.ly * Frame::width;
+                                ppu.render_line(&memory[0x8000], vram_bank1.data(), &memory[Dma::oam_start], tile_cache, sprite_lists, &frame.pixels[line], &frame.indices[line]);
+                            }
+                            if (dma.hblank_active)
+                            {
+                                const auto destination = dma.hdma_destination;
+                                cycles += dma.hblank_block(pages);
+                                vram_copied(destination, dma.hdma_destination);
+                            }
+                            break;
+                        }
+                        case Ppu::vblank:
+                            if (ppu.ly == Ppu::visible_lines)
+                            {
+                                ++frame_count;
+                                if (render_frame && render_thread)
+                                    render_thread->end_frame(frame_count);
+                                else if (render_frame)
+                                {
+                                    ppu.fill_luma(frames.back_buffer().luma);
+                                    frames.publish(frame_count);
+                                }
+                                render_frame = draw_frames && (frame_count + 1) % render_interval == 0;
+                                if (!speculative && !watch_list.watches.empty())
+                                    watch_list.gather(pages, frame_count);
+                                if (frame_count == stop_frame)
+                                    stop();
+                            }
+                            break;
+                        default:
+                            break;
+                    }
+                    break;
+                case Event::oam_dma_end:
+                    dma.oam_active = false;
+                    map_pages();
+                    break;
+                case Event::serial:
+                    if (!finish_serial(at))
+                    {
+                        // In-process link: stop here until Link_cable has run the other side
+                        scheduler.schedule(Event::serial, at);
+                        stop();
+                        return;
+                    }
+                    break;
+                case Event::link_sync:
+                    sync_link();
+                    break;
+                case Event::timer_reload:
+                    if (timer.sync(at))
+                        interrupts.request(Interrupts::timer);
+                    timer.schedule_wakeup(scheduler);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Muted runs keep every APU register and status bit exact but synthesise nothing.
+    void set_audio_muted(bool muted)
+    {
+        if (audio_muted && !muted && !turbo)
+            apu.resume_output(cycles, audio);
+        audio_muted = muted;
+    }
+
+    // Turbo draws only every render_interval-th frame and synthesises no audio. Only host-side
+    // output is skipped, so the machine itself runs exactly as at normal speed. A change takes
+    // effect from the next frame, so no published frame is ever half drawn.
+    void set_turbo(bool enabled, std::uint32_t render_interval_ = 8)
+    {
+        if (turbo && !enabled && !audio_muted)
+            apu.resume_output(cycles, audio);
+        turbo = enabled;
+        render_interval = enabled ? std::max<std::uint32_t>(render_interval_, 1) : 1;
+    }
+
+    Audio_output* audio_output()
+    {
+        return audio_muted || turbo ? nullptr : &audio;
+    }
 
     void run(opcode instruction)
     {
@@ -35,11 +737,26 @@ public:
         x8_Arithmetic_Logic_Unit(instruction);
         control(instruction);
         x16_Load_Store_Move(instruction);
+        x16_Arithmetic_Logic_Unit(instruction);
         x8_Load_Store_Move(instruction);
     }
 
 //private:
 
+    void profiled_step()
+    {
+        if (interrupts.pending && service_interrupts())
+            return;
+        const auto address = registers.program_counter;
+        const auto instruction = pages[address >> 8][address & 0xFF];
+        const auto start_cycles = cycles;
+        const auto start = std::chrono::steady_clock::now();
+        execute();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        if (cycles != start_cycles)
+            profile->record_instruction(address, instruction, cycles - start_cycles, elapsed.count());
+    }
+
     void x8_Rotate_and_Shift_Bits(opcode instruction)
     {
         switch (instruction)
@@ -55,7 +772,10 @@ public:
                 else
                     unset_flags(Flags::carry);
 
-                set_upper(registers.accumulator_and_flags, (A << 1) | (A >> 7));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, (A << 1) | (A >> 7));
+                unset_flags(Flags::zero);
+                unset_flags(Flags::subtraction);
+                unset_flags(Flags::half_carry);
                 break;
             }
             case opcode::RRCA:
@@ -69,7 +789,10 @@ public:
                 else
                     unset_flags(Flags::carry);
 
-                set_upper(registers.accumulator_and_flags, (A >> 1) | (A << 7));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, (A >> 1) | (A << 7));
+                unset_flags(Flags::zero);
+                unset_flags(Flags::subtraction);
+                unset_flags(Flags::half_carry);
                 break;
             }
             case opcode::RLA:                                      
@@ -84,7 +807,10 @@ public:
                 else
                     unset_flags(Flags::carry);
 
-                set_upper(registers.accumulator_and_flags, (A << 1) | (past_carry));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, (A << 1) | (past_carry));
+                unset_flags(Flags::zero);
+                unset_flags(Flags::subtraction);
+                unset_flags(Flags::half_carry);
                 break;                                                            
             }                                                                 
             case opcode::RRA:       
@@ -99,7 +825,10 @@ public:
                 else 
                     unset_flags(Flags::carry);
                     
-                set_upper(registers.accumulator_and_flags, (A>>1) | (past_carry << 7));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, (A>>1) | (past_carry << 7));
+                unset_flags(Flags::zero);
+                unset_flags(Flags::subtraction);
+                unset_flags(Flags::half_carry);
                 break;
             }
         }
@@ -118,8 +847,8 @@ public:
  
     uint16_t pop_from_stack()
     {
-        std::uint16_t lower = read_from_memory(registers.stack_pointer);
-        std::uint16_t higher = read_from_memory(++registers.stack_pointer);
+        std::uint16_t lower = read_from_memory(registers.stack_pointer++);
+        std::uint16_t higher = read_from_memory(registers.stack_pointer++);
 
         return (higher<<8) | lower;
     }
@@ -132,20 +861,10 @@ public:
         return lower | (upper << 8);
     }
 
-    void compare_flags(uint8_t result, uint8_t decrement, uint8_t reg)
-    {
-        if (result == 0) set_flags(Flags::zero);
-        set_flags(Flags::subtraction);
-        if ((get_upper(registers.accumulator_and_flags) & 0xf) > (decrement & 0xf))
-            set_flags(Flags::half_carry);
-        if (reg > decrement) set_flags(Flags::carry);
-    }
-
     void logically_compare_accumulator(uint8_t reg)
     {
-        auto accumulator = get_upper(registers.accumulator_and_flags);
-        uint8_t result = accumulator - reg;
-        compare_flags(result, reg, accumulator);
+        const int A = get_upper(registers.accumulator_and_flags);
+        registers.accumulator_and_flags = set_lower(registers.accumulator_and_flags, get_lower(Alu::subtract[Alu::index(A, reg, A - reg)]));
     }
 
     void logically_or_accumulator(uint8_t reg)
@@ -166,16 +885,16 @@ public:
         registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, A);
     }
 
-    void decrease_accumulator(uint8_t decrement)
+    void decrease_accumulator(uint8_t decrement, bool carry = false)
     {
-        uint8_t A = get_upper(registers.accumulator_and_flags) - decrement;
-        registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, A);
+        const int A = get_upper(registers.accumulator_and_flags);
+        registers.accumulator_and_flags = Alu::subtract[Alu::index(A, decrement, A - decrement - carry)];
     }
 
-    void increase_accumulator(uint8_t increment)
+    void increase_accumulator(uint8_t increment, bool carry = false)
     {
-        uint8_t A = get_upper(registers.accumulator_and_flags) + increment;
-        registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags,A);
+        const int A = get_upper(registers.accumulator_and_flags);
+        registers.accumulator_and_flags = Alu::add[Alu::index(A, increment, A + increment + carry)];
     }
 
     bool is_flag_set(Flags flag)
@@ -198,6 +917,15 @@ public:
         registers.accumulator_and_flags &= ~static_cast<int> (flags);
     }
 
+    void assign_flags(bool zero, bool subtraction, bool half_carry, bool carry)
+    {
+        registers.accumulator_and_flags &= 0xFF00;
+        if (zero) set_flags(Flags::zero);
+        if (subtraction) set_flags(Flags::subtraction);
+        if (half_carry) set_flags(Flags::half_carry);
+        if (carry) set_flags(Flags::carry);
+    }
+
     uint8_t get_lower(uint16_t register_)
     {
         return register_ & 0b0000000011111111;
@@ -220,40 +948,37 @@ public:
         return register_ + lower;
     }
 
+    // INC and DEC leave the carry flag alone.
+    uint8_t increment(uint8_t value)
+    {
+        registers.accumulator_and_flags = (registers.accumulator_and_flags & (0xFF00 | Alu::carry)) | Alu::increment_flags[value];
+        return value + 1;
+    }
+
+    uint8_t decrement(uint8_t value)
+    {
+        registers.accumulator_and_flags = (registers.accumulator_and_flags & (0xFF00 | Alu::carry)) | Alu::decrement_flags[value];
+        return value - 1;
+    }
+
     uint16_t increment_upper(uint16_t register_)
     {
-        uint8_t upper = get_upper(register_);
-        ++upper;
-        if (upper == 0) set_flags(Flags::zero);
-        else unset_flags(Flags::zero);
-        return set_upper(register_,upper);
+        return set_upper(register_, increment(get_upper(register_)));
     }
 
     uint16_t increment_lower(uint16_t register_)
     {
-        uint8_t lower = get_lower(register_);
-        ++lower;
-        if (lower == 0) set_flags(Flags::zero);
-        else unset_flags(Flags::zero);
-        return set_lower(register_, lower);
+        return set_lower(register_, increment(get_lower(register_)));
     }
 
     uint16_t decrement_upper(uint16_t register_)
     {
-        uint8_t upper = get_upper(register_);
-        --upper;
-        if (upper == 0) set_flags(Flags::zero);
-        else unset_flags(Flags::zero);
-        return set_upper(register_, upper);
+        return set_upper(register_, decrement(get_upper(register_)));
     }
 
     uint16_t decrement_lower(uint16_t register_)
     {
-        uint8_t lower = get_lower(register_);
-        --lower;
-        if (lower == 0) set_flags(Flags::zero);
-        else unset_flags(Flags::zero);
-        return set_lower(register_, lower);
+        return set_lower(register_, decrement(get_lower(register_)));
     }
 
     void check_and_toggle_z_flag()
@@ -268,21 +993,7 @@ public:
 
     void subtract_with_carry(uint8_t val)
     {
-        auto decrement = val + is_flag_set(Flags::carry);
-        if (get_upper(registers.accumulator_and_flags) > decrement)
-            set_flags(Flags::carry);
-        else
-            unset_flags(Flags::carry);
-
-        if ((get_upper(registers.accumulator_and_flags) & 0xf) > (decrement & 0xf))
-            set_flags(Flags::half_carry);
-        else
-            unset_flags(Flags::half_carry);
-
-        decrease_accumulator(decrement);
-
-        check_and_toggle_z_flag();
-        set_flags(Flags::subtraction);
+        decrease_accumulator(val, is_flag_set(Flags::carry));
     }
 
     void and_flags()
@@ -366,7 +1077,7 @@ public:
             }
             case opcode::DAA:
             {
-
+                registers.accumulator_and_flags = Alu::decimal_adjust[Alu::decimal_adjust_index(registers.accumulator_and_flags)];
                 break;
             }
             case opcode::INC_L:
@@ -389,12 +1100,12 @@ public:
             }
             case opcode::INC_iHL:
             {
-                memory[registers.HL] += 1;
+                write_to_memory(registers.HL, increment(read_from_memory(registers.HL)));
                 break;
             }
             case opcode::DEC_iHL:
             {
-                memory[registers.HL] -= 1;
+                write_to_memory(registers.HL, decrement(read_from_memory(registers.HL)));
                 break;
             }
             case opcode::SCF:
@@ -406,12 +1117,14 @@ public:
             }
             case opcode::INC_A:
             {
-                registers.accumulator_and_flags = increment_upper(registers.accumulator_and_flags);
+                const auto A = increment(get_upper(registers.accumulator_and_flags));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, A);
                 break;
             }
             case opcode::DEC_A:
             {
-                registers.accumulator_and_flags = decrement_upper(registers.accumulator_and_flags);
+                const auto A = decrement(get_upper(registers.accumulator_and_flags));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, A);
                 break;
             }
             case opcode::CCF:
@@ -453,7 +1166,7 @@ public:
             }
             case opcode::ADD_A_iHL:
             {
-                increase_accumulator(memory[registers.HL]);
+                increase_accumulator(read_from_memory(registers.HL));
                 break;
             }
             case opcode::ADD_A_A:
@@ -463,66 +1176,42 @@ public:
             }
             case opcode::ADC_A_B:
             {
-                std::uint8_t to_add = get_upper(registers.BC);
-                if(is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_upper(registers.BC), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_C:
             {
-                std::uint8_t to_add = get_lower(registers.BC);
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_lower(registers.BC), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_D:
             {
-                std::uint8_t to_add = get_upper(registers.DE);
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_upper(registers.DE), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_E:
             {
-                std::uint8_t to_add = get_lower(registers.DE);
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_lower(registers.DE), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_H:
             {
-                std::uint8_t to_add = get_upper(registers.HL);
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_upper(registers.HL), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_L:
             {
-                std::uint8_t to_add = get_lower(registers.HL);
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_lower(registers.HL), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_iHL:
             {
-                std::uint8_t to_add = memory[registers.HL];
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(read_from_memory(registers.HL), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::ADC_A_A:
             {
-                std::uint8_t to_add = get_upper(registers.accumulator_and_flags);
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(get_upper(registers.accumulator_and_flags), is_flag_set(Flags::carry));
                 break;
             }
             case opcode::SUB_B:
@@ -557,7 +1246,7 @@ public:
             }
             case opcode::SUB_iHL:
             {
-                decrease_accumulator(memory[registers.HL]);
+                decrease_accumulator(read_from_memory(registers.HL));
                 break;
             }
             case opcode::SUB_A:
@@ -597,7 +1286,7 @@ public:
             }
             case opcode::SBC_A_iHL:
             {
-                subtract_with_carry(memory[registers.HL]);
+                subtract_with_carry(read_from_memory(registers.HL));
                 break;
             }
             case opcode::SBC_A_A:
@@ -643,7 +1332,7 @@ public:
             }
             case opcode::AND_iHL:
             {
-                logically_and_accumulator(memory[registers.HL]);
+                logically_and_accumulator(read_from_memory(registers.HL));
                 and_flags();
                 break;
             }
@@ -691,7 +1380,7 @@ public:
             }
             case opcode::XOR_iHL:
             {
-                logically_xor_accumulator(memory[registers.HL]);
+                logically_xor_accumulator(read_from_memory(registers.HL));
                 xor_flags();
                 break;
             }
@@ -739,7 +1428,7 @@ public:
             }
             case opcode::OR_iHL:
             {
-                logically_or_accumulator(memory[registers.HL]);
+                logically_or_accumulator(read_from_memory(registers.HL));
                 or_flags();
                 break;
             }
@@ -781,7 +1470,7 @@ public:
             }
             case opcode::CP_iHL:
             {
-                logically_compare_accumulator(memory[registers.HL]);
+                logically_compare_accumulator(read_from_memory(registers.HL));
                 break;
             }
             case opcode::CP_A:
@@ -791,55 +1480,52 @@ public:
             }
             case opcode::ADD_A_d8:
             {
-                increase_accumulator(memory[registers.program_counter]);
+                increase_accumulator(read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::ADC_A_d8:
             {
-                std::uint8_t to_add = memory[registers.program_counter];
-                if (is_flag_set(Flags::carry))
-                    ++to_add;
-                increase_accumulator(to_add);
+                increase_accumulator(read_from_memory(registers.program_counter), is_flag_set(Flags::carry));
                 ++registers.program_counter;
                 break;
             }
             case opcode::SUB_d8:
             {
-                decrease_accumulator(memory[registers.program_counter]);
+                decrease_accumulator(read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::SBC_A_d8:
             {
-                subtract_with_carry(memory[registers.program_counter]);
+                subtract_with_carry(read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::AND_d8:
             {
-                logically_and_accumulator(memory[registers.program_counter]);
+                logically_and_accumulator(read_from_memory(registers.program_counter));
                 and_flags();
                 ++registers.program_counter;
                 break;
             }
             case opcode::XOR_d8:
             {
-                logically_xor_accumulator(memory[registers.program_counter]);
+                logically_xor_accumulator(read_from_memory(registers.program_counter));
                 xor_flags();
                 ++registers.program_counter;
                 break;
             }
             case opcode::OR_d8:
             {
-                logically_or_accumulator(memory[registers.program_counter]);
+                logically_or_accumulator(read_from_memory(registers.program_counter));
                 or_flags();
                 ++registers.program_counter;
                 break;
             }
             case opcode::CP_d8:
             {
-                logically_compare_accumulator(memory[registers.program_counter]);
+                logically_compare_accumulator(read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
@@ -848,16 +1534,397 @@ public:
 
     void write_to_memory(std::uint16_t address, uint8_t value)
     { 
-        if (address == 0x0FF01)
-            std::cout << static_cast<char> (value);
+        if (const auto page = write_pages[address >> 8])
+            page[address & 0xFF] = value;
         else
-            memory[address] = value;
+            slow_write(address, value);
     }
     std::uint8_t read_from_memory(std::uint16_t address)
     {
+        if (const auto page = read_pages[address >> 8])
+            return page[address & 0xFF];
+        return slow_read(address);
+    }
+
+    // Debugger access: no I/O side effects, watchpoints or profiling.
+    std::uint8_t peek(std::uint16_t address)
+    {
+        if (address >= 0xFF00)
+            return read_io(address);
+        return pages[address >> 8][address & 0xFF];
+    }
+
+    void poke(std::uint16_t address, std::uint8_t value)
+    {
+        if (address >= 0xFF00)
+            write_io(address, value);
+        else
+            write_memory(address, value);
+    }
+
+    std::uint8_t fetch_instruction()
+    {
+        const auto address = registers.program_counter++;
+        if (const auto page = read_pages[address >> 8])
+            return page[address & 0xFF];
+        return slow_fetch(address);
+    }
+
+    std::uint8_t slow_fetch(std::uint16_t address)
+    {
+        if (debugger && !std::exchange(debugger->resuming, false))
+        {
+            for (const auto& breakpoint : debugger->breakpoints)
+            {
+                if (breakpoint.address == address && (!breakpoint.condition || breakpoint.condition(*this)))
+                {
+                    --registers.program_counter;
+                    debugger->stop(Stop_reason::breakpoint, address);
+                    debugger->resuming = true;
+                    stop();
+                    return breakpoint_trap;
+                }
+            }
+        }
+        return slow_read(address);
+    }
+
+    void check_watchpoints(std::uint16_t address, Access access)
+    {
+        for (const auto& watchpoint : debugger->watchpoints)
+        {
+            if ((static_cast<int>(watchpoint.access) & static_cast<int>(access)) != 0
+                && watchpoint.first <= address && address <= watchpoint.last
+                && (!watchpoint.condition || watchpoint.condition(*this)))
+            {
+                debugger->stop(Stop_reason::watchpoint, address, access);
+                stop();
+                return;
+            }
+        }
+    }
+
+    void slow_write(std::uint16_t address, std::uint8_t value)
+    {
+        if (profile)
+            ++profile->page_writes[address >> 8];
+        if (debugger)
+            check_watchpoints(address, Access::write);
+        if (dma.oam_active && address < 0xFF00)
+            return;
+
+        if (address >= 0xFF00)
+            write_io(address, value);
+        else
+            write_memory(address, value);
+    }
+
+    void write_memory(std::uint16_t address, std::uint8_t value)
+    {
+        pages[address >> 8][address & 0xFF] = value;
+        if (address < 0x8000 && compiled_rom)
+        {
+            // The block doing the write may be one that changes
+            validate_compiled_blocks(address, address + 1u);
+            cycle_target = cycles;
+        }
+        else if (address >= 0x8000 && address < 0xA000)
+        {
+            tile_cache.invalidate(vram_bank, address - 0x8000);
+            if (render_thread)
+                render_thread->write(Video_write::vram, address, value, cycles, vram_bank);
+        }
+        else if (address >= Dma::oam_start && address < Dma::oam_start + Dma::oam_size)
+        {
+            sprite_lists.dirty = true;
+            if (render_thread)
+                render_thread->write(Video_write::oam, address, value, cycles);
+        }
+    }
+
+    void write_ppu(std::uint16_t address, std::uint8_t value)
+    {
+        ppu.write(address, value, cycles, scheduler, interrupts);
+        if (render_thread)
+            render_thread->write(Video_write::ppu_register, address, value, cycles);
+    }
+
+    // HDMA copied VRAM from offset `from` up to `to`, wrapping at the end of the bank.
+    void vram_copied(std::uint16_t from, std::uint16_t to)
+    {
+        if (to >= from)
+            vram_range_written(from, to - from);
+        else
+        {
+            vram_range_written(from, 0x2000 - from);
+            vram_range_written(0, to);
+        }
+    }
+
+    void vram_range_written(std::uint16_t offset, std::size_t size)
+    {
+        tile_cache.invalidate(vram_bank, offset, size);
+        if (render_thread)
+        {
+            const auto bank = vram_bank_view(vram_bank);
+            for (std::size_t i = offset; i < offset + size; ++i)
+                render_thread->write(Video_write::vram, static_cast<std::uint16_t>(0x8000 + i), bank[i], cycles, vram_bank);
+        }
+    }
+
+    void write_io(std::uint16_t address, std::uint8_t value)
+    {
+        if (address == Joypad::P1)
+            joypad.write(value);
+        else if (address == Serial::SB || address == Serial::SC)
+            write_serial(address, value);
+        else if (address >= Timer::DIV && address <= Timer::TAC)
+        {
+            bool interrupt = false;
+            if (timer.write(address, value, cycles, scheduler, interrupt))
+                apu.frame_sequencer(cycles, scheduler, audio_output());
+            else if (address == Timer::DIV)
+                scheduler.schedule(Event::apu_frame_sequencer, cycles + Apu::frame_sequencer_period);
+            if (interrupt)
+                interrupts.request(Interrupts::timer);
+        }
+        else if (address == Interrupts::IF || address == Interrupts::IE)
+            interrupts.write(address, value);
+        else if (address == Dma::OAM_DMA)
+        {
+            dma.start_oam(value, cycles, pages, scheduler, speed_shift);
+            sprite_lists.dirty = true;
+            if (render_thread)
+                for (std::uint16_t address = Dma::oam_start; address < Dma::oam_start + Dma::oam_size; ++address)
+                    render_thread->write(Video_write::oam, address, memory[address], cycles);
+            map_pages();
+        }
+        else if (address >= Ppu::LCDC && address <= Ppu::WX)
+            write_ppu(address, value);
+        else if (cgb_register(address))
+            write_cgb_register(address, value);
+        else if (address >= Apu::first_register && address <= Apu::last_address)
+            apu.write(address, value, cycles, audio_output());
+        else
+            memory[address] = value;
+    }
+
+    std::uint8_t read_io(std::uint16_t address)
+    {
+        if (address == Joypad::P1)
+            return joypad.read();
+        if (address >= Timer::DIV && address <= Timer::TAC)
+        {
+            bool interrupt = false;
+            const auto value = timer.read(address, cycles, interrupt);
+            if (interrupt)
+                interrupts.request(Interrupts::timer);
+            return value;
+        }
+        if (address == Interrupts::IF || address == Interrupts::IE)
+            return interrupts.read(address);
+        if (address == Serial::SB || address == Serial::SC)
+            return serial.read(address, cgb);
+        if (address == Dma::OAM_DMA)
+            return dma.read(address);
+        if (address >= Ppu::LCDC && address <= Ppu::WX)
+            return ppu.read(address);
+        if (cgb_register(address))
+            return read_cgb_register(address);
+        if (address >= Apu::first_register && address <= Apu::last_address)
+            return apu.read(address, cycles, audio_output());
         return memory[address];
     }
 
+    void write_serial(std::uint16_t address, std::uint8_t value)
+    {
+        if (!serial.write(address, value, cgb, cycles, speed_shift, scheduler))
+            return;
+        if (serial.exchange_pending)
+        {
+            // Switched to the internal clock while the other side was sending: it gets nothing
+            serial.exchange_pending = false;
+            if (link && link->connected())
+                link->send({ Link_message::reply, 0xFF, cycles - link->base });
+        }
+        if (link && link->connected())
+            link->send({ Link_message::transfer, serial.data, scheduler.deadline(Event::serial) - link->base });
+        else if (serial_output && !speculative)
+            *serial_output << static_cast<char>(serial.data);
+    }
+
+    // Handles everything the other side of the link has sent so far.
+    void poll_link()
+    {
+        Link_message message;
+        while (link && link->receive(message))
+        {
+            switch (message.kind)
+            {
+                case Link_message::transfer:
+                    // Only a side on the external clock listens; with both driving the clock
+                    // the bits are lost.
+                    if (serial.internal_clock() || serial.exchange_pending)
+                        link->send({ Link_message::reply, 0xFF, message.at });
+                    else
+                    {
+                        serial.exchange_pending = true;
+                        serial.incoming = message.data;
+                        scheduler.schedule(Event::serial, std::max(message.at + link->base, cycles));
+                    }
+                    break;
+                case Link_message::reply:
+                    link->reply = message.data;
+                    break;
+                case Link_message::time:
+                    link->peer_time = message.at;
+                    break;
+            }
+        }
+    }
+
+    // Event::serial: the end of a transfer. Returns false if the other side's byte is not
+    // there yet and can only be had by letting that side run.
+    bool finish_serial(std::uint64_t at)
+    {
+        if (serial.exchange_pending)
+        {
+            // Unless a transfer was started here, nothing shifts and the other side reads 0xFF
+            serial.exchange_pending = false;
+            const bool active = serial.active();
+            if (link && link->connected())
+                link->send({ Link_message::reply, active ? serial.data : std::uint8_t{ 0xFF }, at - link->base });
+            if (active)
+            {
+                serial.complete(serial.incoming);
+                interrupts.request(Interrupts::serial);
+            }
+            return true;
+        }
+
+        poll_link();
+        while (link && link->connected() && !link->reply)
+        {
+            if (!link->remote())
+                return false;
+            // So that the other side is never held back waiting for this one
+            link->send({ Link_message::time, 0, cycles - link->base });
+            link->wait();
+            poll_link();
+        }
+        const std::uint8_t received = link && link->reply ? *link->reply : 0xFF;
+        if (link)
+            link->reply.reset();
+        // SC was written since to stop the transfer or hand the clock to the other side
+        if (!serial.active() || !serial.internal_clock())
+            return true;
+        serial.complete(received);
+        interrupts.request(Interrupts::serial);
+        return true;
+    }
+
+    // Event::link_sync, over a socket only: reports this side's time and holds back while
+    // it is more than max_lead ahead of the other. An exchange that arrives meanwhile has the
+    // other side waiting on it, so this side then runs on for one transfer time, enough to
+    // make the exchange and get ready for the next, and checks again after that.
+    void sync_link()
+    {
+        if (!link || !link->remote())
+            return;
+        link->send({ Link_message::time, 0, cycles - link->base });
+        poll_link();
+        std::uint64_t next = cycles + link->sync_interval;
+        while (link->remote() && cycles - link->base > link->peer_time + link->max_lead)
+        {
+            if (serial.exchange_pending)
+            {
+                next = cycles + Serial::transfer_dots;
+                break;
+            }
+            link->wait();
+            poll_link();
+        }
+        scheduler.schedule(Event::link_sync, next);
+    }
+
+    static bool cgb_register(std::uint16_t address)
+    {
+        return address == KEY1 || address == VBK || address == SVBK
+            || (address >= Dma::HDMA1 && address <= Dma::HDMA5)
+            || (address >= Ppu::BCPS && address <= Ppu::OCPD);
+    }
+
+    // Absent on DMG: reads give 0xFF and writes are dropped.
+    void write_cgb_register(std::uint16_t address, std::uint8_t value)
+    {
+        if (!cgb)
+            return;
+        if (address == KEY1)
+            speed_switch_prepared = (value & 0x01) != 0;
+        else if (address == VBK || address == SVBK)
+        {
+            if (address == VBK)
+                vram_bank = value & 0x01;
+            else
+                wram_bank = std::max(value & 0x07, 1);
+            map_memory();
+            map_pages();
+        }
+        else if (address >= Dma::HDMA1 && address <= Dma::HDMA5)
+        {
+            const auto destination = dma.hdma_destination;
+            cycles += dma.write(address, value, pages, !ppu.enabled() || ppu.mode == Ppu::hblank);
+            if (address == Dma::HDMA5)
+                vram_copied(destination, dma.hdma_destination);
+        }
+        else
+            write_ppu(address, value);
+    }
+
+    std::uint8_t read_cgb_register(std::uint16_t address)
+    {
+        if (!cgb)
+            return 0xFF;
+        if (address == KEY1)
+            return 0x7E | speed_shift << 7 | (speed_switch_prepared ? 0x01 : 0);
+        if (address == VBK)
+            return 0xFE | vram_bank;
+        if (address == SVBK)
+            return 0xF8 | wram_bank;
+        if (address >= Dma::HDMA1 && address <= Dma::HDMA5)
+            return dma.read(address);
+        return ppu.read(address);
+    }
+
+    // STOP resets DIV; on CGB with KEY1 armed it also flips the CPU speed.
+    void stop_instruction()
+    {
+        write_io(Timer::DIV, 0);
+        if (!cgb || !speed_switch_prepared)
+            return;
+        speed_switch_prepared = false;
+        bool interrupt = false;
+        timer.set_speed(speed_shift ^ 1, cycles, scheduler, interrupt);
+        speed_shift = timer.speed_shift;
+        if (interrupt)
+            interrupts.request(Interrupts::timer);
+        cycles += speed_switch_dots;
+    }
+
+    std::uint8_t slow_read(std::uint16_t address)
+    {
+        if (profile)
+            ++profile->page_reads[address >> 8];
+        if (debugger)
+            check_watchpoints(address, Access::read);
+        if (dma.oam_active && address < 0xFF00)
+            return 0xFF;
+
+        if (address >= 0xFF00)
+            return read_io(address);
+        return pages[address >> 8][address & 0xFF];
+    }
+
     void x8_Load_Store_Move(opcode instruction)
     {
         switch (instruction)
@@ -869,18 +1936,18 @@ public:
             }
             case opcode::LD_B_d8:
             {
-                set_upper(registers.BC,read_from_memory(registers.program_counter));
+                registers.BC = set_upper(registers.BC, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::LD_A_iBC:
             {
-                set_upper(registers.accumulator_and_flags, read_from_memory(registers.BC));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(registers.BC));
                 break;
             }
             case opcode::LD_C_d8:
             {
-                set_lower(registers.BC,read_from_memory(registers.program_counter));
+                registers.BC = set_lower(registers.BC, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
@@ -891,18 +1958,18 @@ public:
             }
             case opcode::LD_D_d8:
             {
-                set_upper(registers.DE,read_from_memory(registers.program_counter));
+                registers.DE = set_upper(registers.DE, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::LD_A_iDE:
             {
-                set_upper(registers.accumulator_and_flags, read_from_memory(registers.DE));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(registers.DE));
                 break;
             }
             case opcode::LD_E_d8:
             {
-                set_lower(registers.DE,read_from_memory(registers.program_counter));
+                registers.DE = set_lower(registers.DE, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
@@ -914,19 +1981,19 @@ public:
             }
             case opcode::LD_H_d8:
             {
-                set_upper(registers.HL,read_from_memory(registers.program_counter));
+                registers.HL = set_upper(registers.HL, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::LD_A_iHLinc:
             {
-                set_upper(registers.accumulator_and_flags, read_from_memory(registers.HL));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(registers.HL));
                 ++registers.HL;
                 break;
             }
             case opcode::LD_L_d8:
             {
-                set_lower(registers.HL, read_from_memory(registers.program_counter));
+                registers.HL = set_lower(registers.HL, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
@@ -938,19 +2005,19 @@ public:
             }
             case opcode::LD_iHL_d8:
             {
-                write_to_memory(registers.HL, get_upper(registers.accumulator_and_flags));
+                write_to_memory(registers.HL, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
             case opcode::LD_A_iHLdec:
             {
-                set_upper(registers.accumulator_and_flags, read_from_memory(registers.HL));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(registers.HL));
                 --registers.HL;
                 break;
             }
             case opcode::LD_A_d8:
             {
-                set_upper(registers.accumulator_and_flags, read_from_memory(registers.program_counter));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(registers.program_counter));
                 ++registers.program_counter;
                 break;
             }
@@ -961,42 +2028,42 @@ public:
             }
             case opcode::LD_B_C:
             {
-                set_upper(registers.BC, get_lower(registers.BC));
+                registers.BC = set_upper(registers.BC, get_lower(registers.BC));
                 break;
             }
             case opcode::LD_B_D:
             {
-                set_upper(registers.BC,get_upper(registers.DE));
+                registers.BC = set_upper(registers.BC, get_upper(registers.DE));
                 break;
             }
             case opcode::LD_B_E:
             {
-                set_upper(registers.BC,get_lower(registers.DE));
+                registers.BC = set_upper(registers.BC, get_lower(registers.DE));
                 break;
             }
             case opcode::LD_B_H:
             {
-                set_upper(registers.BC,get_upper(registers.HL));
+                registers.BC = set_upper(registers.BC, get_upper(registers.HL));
                 break;
             }
             case opcode::LD_B_L:
             {
-                set_upper(registers.BC, get_lower(registers.HL));
+                registers.BC = set_upper(registers.BC, get_lower(registers.HL));
                 break;
             }
             case opcode::LD_B_iHL:
             {
-                set_upper(registers.BC,read_from_memory(registers.HL));
+                registers.BC = set_upper(registers.BC, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_B_A:
             {
-                set_upper(registers.BC,get_upper(registers.accumulator_and_flags));
+                registers.BC = set_upper(registers.BC, get_upper(registers.accumulator_and_flags));
                 break;
             }
             case opcode::LD_C_B:
             {
-                set_lower(registers.BC,get_upper(registers.BC));
+                registers.BC = set_lower(registers.BC, get_upper(registers.BC));
                 break;
             }
             case opcode::LD_C_C:
@@ -1006,42 +2073,42 @@ public:
             }
             case opcode::LD_C_D:
             {
-                set_lower(registers.BC, get_upper(registers.DE));
+                registers.BC = set_lower(registers.BC, get_upper(registers.DE));
                 break;
             }
             case opcode::LD_C_E:
             {
-                set_lower(registers.BC,get_lower(registers.DE));
+                registers.BC = set_lower(registers.BC, get_lower(registers.DE));
                 break;
             }
             case opcode::LD_C_H:
             {
-                set_lower(registers.BC,get_upper(registers.HL));
+                registers.BC = set_lower(registers.BC, get_upper(registers.HL));
                 break;
             }
             case opcode::LD_C_L:
             {
-                set_lower(registers.BC,get_lower(registers.HL));
+                registers.BC = set_lower(registers.BC, get_lower(registers.HL));
                 break;
             }
             case opcode::LD_C_iHL:
             {
-                set_lower(registers.BC, memory[registers.HL]);
+                registers.BC = set_lower(registers.BC, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_C_A:
             {
-                set_lower(registers.BC,get_upper(registers.accumulator_and_flags));
+                registers.BC = set_lower(registers.BC, get_upper(registers.accumulator_and_flags));
                 break;
             }
             case opcode::LD_D_B:
             {
-                set_upper(registers.DE,get_upper(registers.BC));
+                registers.DE = set_upper(registers.DE, get_upper(registers.BC));
                 break;
             }
             case opcode::LD_D_C:
             {
-                set_upper(registers.DE, get_lower(registers.BC));
+                registers.DE = set_upper(registers.DE, get_lower(registers.BC));
                 break;
             }
             case opcode::LD_D_D:
@@ -1051,41 +2118,42 @@ public:
             }
             case opcode::LD_D_E:
             {
-                set_upper(registers.DE,get_lower(registers.DE));
+                registers.DE = set_upper(registers.DE, get_lower(registers.DE));
                 break;
             }
             case opcode::LD_D_H:
             {
-                set_upper(registers.DE,get_upper(registers.HL));
+                registers.DE = set_upper(registers.DE, get_upper(registers.HL));
                 break;
             }
             case opcode::LD_D_L:
             {
-                set_upper(registers.DE,get_lower(registers.HL));
+                registers.DE = set_upper(registers.DE, get_lower(registers.HL));
                 break;
             }
             case opcode::LD_D_iHL:
             {
-                set_upper(registers.DE,read_from_memory(registers.HL));
+                registers.DE = set_upper(registers.DE, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_D_A:
             {
-                set_upper(registers.DE, get_upper(registers.accumulator_and_flags));
+                registers.DE = set_upper(registers.DE, get_upper(registers.accumulator_and_flags));
                 break;
             }
             case opcode::LD_E_B:
             {
-                set_lower(registers.DE, get_upper(registers.BC));
+                registers.DE = set_lower(registers.DE, get_upper(registers.BC));
                 break;
             }
             case opcode::LD_E_C:
             {
+                registers.DE = set_lower(registers.DE, get_lower(registers.BC));
                 break;
             }
             case opcode::LD_E_D:
             {
-                set_lower(registers.DE,get_upper(registers.DE));
+                registers.DE = set_lower(registers.DE, get_upper(registers.DE));
                 break;
             }
             case opcode::LD_E_E:
@@ -1095,42 +2163,42 @@ public:
             }
             case opcode::LD_E_H:
             {
-                set_lower(registers.DE,get_upper(registers.HL));
+                registers.DE = set_lower(registers.DE, get_upper(registers.HL));
                 break;
             }
             case opcode::LD_E_L:
             {
-                set_lower(registers.DE,get_lower(registers.HL));
+                registers.DE = set_lower(registers.DE, get_lower(registers.HL));
                 break;
             }
             case opcode::LD_E_iHL:
             {
-                set_lower(registers.DE,get_lower(registers.DE));
+                registers.DE = set_lower(registers.DE, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_E_A:
             {
-                set_lower(registers.DE,get_upper(registers.accumulator_and_flags));
+                registers.DE = set_lower(registers.DE, get_upper(registers.accumulator_and_flags));
                 break;
             }
             case opcode::LD_H_B:
             {
-                set_upper(registers.HL,get_upper(registers.BC));
+                registers.HL = set_upper(registers.HL, get_upper(registers.BC));
                 break;
             }
             case opcode::LD_H_C:
             {
-                set_upper(registers.HL,get_lower(registers.BC));
+                registers.HL = set_upper(registers.HL, get_lower(registers.BC));
                 break;
             }
             case opcode::LD_H_D:
             {
-                set_upper(registers.HL,get_upper(registers.DE));
+                registers.HL = set_upper(registers.HL, get_upper(registers.DE));
                 break;
             }
             case opcode::LD_H_E:
             {
-                set_upper(registers.HL,get_lower(registers.DE));
+                registers.HL = set_upper(registers.HL, get_lower(registers.DE));
                 break;
             }
             case opcode::LD_H_H:
@@ -1140,42 +2208,42 @@ public:
             }
             case opcode::LD_H_L:
             {
-                set_upper(registers.HL, get_lower(registers.HL));
+                registers.HL = set_upper(registers.HL, get_lower(registers.HL));
                 break;
             }
             case opcode::LD_H_iHL:
             {
-                set_upper(registers.HL, memory[registers.HL]);
+                registers.HL = set_upper(registers.HL, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_H_A:
             {
-                set_upper(registers.HL, get_upper(registers.accumulator_and_flags));
+                registers.HL = set_upper(registers.HL, get_upper(registers.accumulator_and_flags));
                 break;
             }
             case opcode::LD_L_B:
             {
-                set_lower(registers.HL,get_upper(registers.BC));
+                registers.HL = set_lower(registers.HL, get_upper(registers.BC));
                 break;
             }
             case opcode::LD_L_C:
             {
-                set_lower(registers.HL,get_lower(registers.BC));
+                registers.HL = set_lower(registers.HL, get_lower(registers.BC));
                 break;
             }
             case opcode::LD_L_D:
             {
-                set_lower(registers.HL,get_upper(registers.DE));
+                registers.HL = set_lower(registers.HL, get_upper(registers.DE));
                 break;
             }
             case opcode::LD_L_E:
             {
-                set_lower(registers.HL,get_lower(registers.DE));
+                registers.HL = set_lower(registers.HL, get_lower(registers.DE));
                 break;
             }
             case opcode::LD_L_H:
             {
-                set_lower(registers.HL,get_upper(registers.HL));
+                registers.HL = set_lower(registers.HL, get_upper(registers.HL));
                 break;
             }
             case opcode::LD_L_L:
@@ -1185,12 +2253,12 @@ public:
             }
             case opcode::LD_L_iHL:
             {
-                set_lower(registers.HL,read_from_memory(registers.HL));
+                registers.HL = set_lower(registers.HL, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_L_A:
             {
-                set_lower(registers.HL,get_upper(registers.accumulator_and_flags));
+                registers.HL = set_lower(registers.HL, get_upper(registers.accumulator_and_flags));
                 break;
             }
             case opcode::LD_iHL_B:
@@ -1230,37 +2298,37 @@ public:
             }
             case opcode::LD_A_B:
             {
-                set_upper(registers.accumulator_and_flags,get_upper(registers.BC));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, get_upper(registers.BC));
                 break;
             }
             case opcode::LD_A_C:
             {
-                set_upper(registers.accumulator_and_flags,get_lower(registers.BC));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, get_lower(registers.BC));
                 break;
             }
             case opcode::LD_A_D:
             {
-                set_upper(registers.accumulator_and_flags,get_upper(registers.DE));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, get_upper(registers.DE));
                 break;
             }
             case opcode::LD_A_E:
             {
-                set_upper(registers.accumulator_and_flags,get_lower(registers.DE));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, get_lower(registers.DE));
                 break;
             }
             case opcode::LD_A_H:
             {
-                set_upper(registers.accumulator_and_flags,get_upper(registers.HL));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, get_upper(registers.HL));
                 break;
             }
             case opcode::LD_A_L:
             {
-                set_upper(registers.accumulator_and_flags,get_lower(registers.HL));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, get_lower(registers.HL));
                 break;
             }
             case opcode::LD_A_iHL:
             {
-                set_upper(registers.accumulator_and_flags,read_from_memory(registers.HL));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(registers.HL));
                 break;
             }
             case opcode::LD_A_A:
@@ -1286,19 +2354,19 @@ public:
             case opcode::LDH_A_ia8:
             {
                 const auto address = read_from_memory(registers.program_counter++) + 0xFF00;
-                set_upper(registers.accumulator_and_flags,read_from_memory(address));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(address));
                 break;
             }
             case opcode::LD_A_iC:
             {
                 const auto address = get_lower(registers.BC) + 0xFF00;
-                set_upper(registers.accumulator_and_flags, read_from_memory(address));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(address));
                 break;
             }
             case opcode::LD_A_ia16:
             {
                 const auto address = read_16b_value();
-                set_upper(registers.accumulator_and_flags, read_from_memory(address));
+                registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, read_from_memory(address));
                 break;
             }
         }
@@ -1332,6 +2400,9 @@ public:
                 if (!is_flag_set(Flags::zero))
                 {
                     registers.program_counter += offset;
+                    cycles += 4 >> speed_shift;
+                    if (offset < 0)
+                        skip_idle_loop(registers.program_counter - offset - 2);
                 }
                 break;
             }
@@ -1347,6 +2418,9 @@ public:
                 if (is_flag_set(Flags::zero))
                 {
                     registers.program_counter += offset;
+                    cycles += 4 >> speed_shift;
+                    if (offset < 0)
+                        skip_idle_loop(registers.program_counter - offset - 2);
                 }
                 break;
             }
@@ -1362,6 +2436,7 @@ public:
                 if (!is_flag_set(Flags::carry))
                 {
                     registers.program_counter += offset;
+                    cycles += 4 >> speed_shift;
                 }
                 break;
             }
@@ -1377,13 +2452,17 @@ public:
                 if (is_flag_set(Flags::carry))
                 {
                     registers.program_counter += offset;
+                    cycles += 4 >> speed_shift;
                 }
                 break;
             }
             case opcode::RET_NZ:
             {
-                if(!is_flag_set(Flags::zero))
+                if (!is_flag_set(Flags::zero))
+                {
                     registers.program_counter = pop_from_stack();
+                    cycles += 12 >> speed_shift;
+                }
                 break;
             }
             case opcode::JP_NZ_a16:
@@ -1395,6 +2474,7 @@ public:
                 {
                     const std::uint16_t target_address = lower | (upper << 8);
                     registers.program_counter = target_address;
+                    cycles += 4 >> speed_shift;
                 }
                 break;
             }
@@ -1417,6 +2497,7 @@ public:
                     push_to_stack(registers.program_counter);
                     const std::uint16_t target_address = lower | (upper << 8);
                     registers.program_counter = target_address;
+                    cycles += 12 >> speed_shift;
                 }
                 break;
             }
@@ -1429,7 +2510,10 @@ public:
             case opcode::RET_Z:
             {
                 if (is_flag_set(Flags::zero))
+                {
                     registers.program_counter = pop_from_stack();
+                    cycles += 12 >> speed_shift;
+                }
                 break;
             }
             case opcode::RET:
@@ -1439,12 +2523,14 @@ public:
             }
             case opcode::JP_Z_a16:
             {
+                const int lower = read_from_memory(registers.program_counter++);
+                const int upper = read_from_memory(registers.program_counter++);
+
                 if (is_flag_set(Flags::zero))
                 {
-                    const int lower = read_from_memory(registers.program_counter++);
-                    const int upper = read_from_memory(registers.program_counter++);
                     const std::uint16_t target_address = lower | (upper << 8);
                     registers.program_counter = target_address;
+                    cycles += 4 >> speed_shift;
                 }
                 break;
             }
@@ -1453,11 +2539,12 @@ public:
                 const int lower = read_from_memory(registers.program_counter++);
                 const int upper = read_from_memory(registers.program_counter++);
 
-                if (!is_flag_set(Flags::zero))
+                if (is_flag_set(Flags::zero))
                 {
                     push_to_stack(registers.program_counter);
                     const std::uint16_t target_address = lower | (upper << 8);
                     registers.program_counter = target_address;
+                    cycles += 12 >> speed_shift;
                 }
                 break;
             }
@@ -1480,17 +2567,22 @@ public:
             case opcode::RET_NC:
             {
                 if (!is_flag_set(Flags::carry))
+                {
                     registers.program_counter = pop_from_stack();
+                    cycles += 12 >> speed_shift;
+                }
                 break;
             }
             case opcode::JP_NC_a16:
             {
+                const int lower = read_from_memory(registers.program_counter++);
+                const int upper = read_from_memory(registers.program_counter++);
+
                 if (!is_flag_set(Flags::carry))
                 {
-                    const int lower = read_from_memory(registers.program_counter++);
-                    const int upper = read_from_memory(registers.program_counter++);
                     const std::uint16_t target_address = lower | (upper << 8);
                     registers.program_counter = target_address;
+                    cycles += 4 >> speed_shift;
                 }
                 break;
             }
@@ -1503,6 +2595,7 @@ public:
                     const std::uint16_t target_address = lower | (upper << 8);
                     push_to_stack(registers.program_counter);
                     registers.program_counter = target_address;
+                    cycles += 12 >> speed_shift;
                 }
                 break;
             }
@@ -1515,27 +2608,72 @@ public:
             case opcode::RET_C:
             {
                 if (is_flag_set(Flags::carry))
+                {
                     registers.program_counter = pop_from_stack();
+                    cycles += 12 >> speed_shift;
+                }
                 break;
             }
-            case opcode::RETI: // interrupts
+            case opcode::STOP_0:
             {
-                
+                ++registers.program_counter;
+                stop_instruction();
+                break;
+            }
+            case opcode::RETI:
+            {
+                registers.program_counter = pop_from_stack();
+                interrupts.master = true;
+                interrupts.update();
+                break;
+            }
+            case opcode::DI:
+            {
+                interrupts.master = false;
+                interrupts.enable_delay = false;
+                interrupts.update();
+                break;
+            }
+            case opcode::EI:
+            {
+                if (!interrupts.master)
+                    interrupts.enable_delay = true;
+                interrupts.update();
+                break;
+            }
+            case opcode::HALT:
+            {
+                if (!interrupts.master && interrupts.requested() != 0)
+                    interrupts.halt_bug = true;
+                else
+                    interrupts.halted = true;
+                interrupts.update();
                 break;
             }
             case opcode::JP_C_a16:
             {
-                if (!is_flag_set(Flags::carry))
+                const int lower = read_from_memory(registers.program_counter++);
+                const int upper = read_from_memory(registers.program_counter++);
+
+                if (is_flag_set(Flags::carry))
                 {
-                    const int lower = read_from_memory(registers.program_counter++);
-                    const int upper = read_from_memory(registers.program_counter++);
                     const std::uint16_t target_address = lower | (upper << 8);
                     registers.program_counter = target_address;
+                    cycles += 4 >> speed_shift;
                 }
                 break;
             }
             case opcode::CALL_C_a16:
             {
+                const int lower = read_from_memory(registers.program_counter++);
+                const int upper = read_from_memory(registers.program_counter++);
+                if (is_flag_set(Flags::carry))
+                {
+                    const std::uint16_t target_address = lower | (upper << 8);
+                    push_to_stack(registers.program_counter);
+                    registers.program_counter = target_address;
+                    cycles += 12 >> speed_shift;
+                }
                 break;
             }
             case opcode::RST_18H:
@@ -1552,7 +2690,7 @@ public:
             }
             case opcode::JP_iHL:
             {
-                registers.program_counter = memory[registers.HL];
+                registers.program_counter = registers.HL;
                 break;
             }
             case opcode::RST_28H:
@@ -1573,6 +2711,300 @@ public:
                 registers.program_counter = 0x38;
                 break;
             }
+            case opcode::PREFIX_CB:
+            {
+                prefix_cb(read_from_memory(registers.program_counter++));
+                break;
+            }
+        }
+    }
+
+    // Called after a backward JR NZ/JR Z, with the jump's address. A loop whose body only loads
+    // A from addresses that change at scheduled events and tests it behaves identically on every
+    // pass until the next event, so whole passes are skipped up to just before it; stepping
+    // resumes for the last one. The result is identical to running every pass.
+    void skip_idle_loop(std::uint16_t branch)
+    {
+        const auto head = registers.program_counter;
+        if (!skip_idle_loops || profile || debugger || interrupts.pending)
+            return;
+        if (idle_loop.head == head && idle_loop.branch == branch && idle_loop.period != 0 && idle_loop.cycle_target == cycle_target
+            && idle_loop.registers == registers && cycles - idle_loop.cycles == idle_loop.period)
+        {
+            if (cycles + idle_loop.period < cycle_target)
+                cycles += (cycle_target - 1 - cycles) / idle_loop.period * idle_loop.period;
+            idle_loop.cycles = cycles;
+            return;
+        }
+        // Known non-polling loops are not decoded again on every pass.
+        if (idle_loop.head != head || idle_loop.branch != branch || idle_loop.period != 0)
+            idle_loop.period = polling_loop_period(head, branch);
+        idle_loop.head = head;
+        idle_loop.branch = branch;
+        idle_loop.cycles = cycles;
+        idle_loop.cycle_target = cycle_target;
+        idle_loop.registers = registers;
+    }
+
+    // Cycles per pass of the loop [head, branch] if its body only reads pollable addresses into A
+    // and tests A or the flags, 0 otherwise.
+    std::uint32_t polling_loop_period(std::uint16_t head, std::uint16_t branch)
+    {
+        if (branch - head > max_idle_loop_bytes)
+            return 0;
+        const auto code = [this](std::uint16_t address) { return pages[address >> 8][address & 0xFF]; };
+        std::uint32_t period = opcode_cycles[static_cast<int>(opcode::JR_NZ_r8)] + 4;
+        for (std::uint16_t address = head; address != branch;)
+        {
+            const std::uint8_t instruction = code(address++);
+            period += opcode_cycles[instruction];
+            switch (opcode{ instruction })
+            {
+                case opcode::LDH_A_ia8:
+                    if (!pollable(0xFF00 | code(address++)))
+                        return 0;
+                    break;
+                case opcode::LD_A_ia16:
+                    if (!pollable(code(address) | code(address + 1) << 8))
+                        return 0;
+                    address += 2;
+                    break;
+                case opcode::LD_A_iC:
+                    if (!pollable(0xFF00 | get_lower(registers.BC)))
+                        return 0;
+                    break;
+                case opcode::LD_A_iBC:
+                case opcode::LD_A_iDE:
+                case opcode::LD_A_iHL:
+                case opcode::AND_iHL:
+                case opcode::OR_iHL:
+                case opcode::CP_iHL:
+                {
+                    const auto source = instruction == 0x0A ? registers.BC : instruction == 0x1A ? registers.DE : registers.HL;
+                    if (!pollable(source))
+                        return 0;
+                    break;
+                }
+                case opcode::AND_d8:
+                case opcode::XOR_d8:
+                case opcode::OR_d8:
+                case opcode::CP_d8:
+                    ++address;
+                    break;
+                case opcode::PREFIX_CB:
+                {
+                    // BIT only
+                    const std::uint8_t operation = code(address++);
+                    if (operation >> 6 != 1 || ((operation & 0x07) == 6 && !pollable(registers.HL)))
+                        return 0;
+                    period += (operation & 0x07) == 6 ? 8 : 4;
+                    break;
+                }
+                default:
+                    // AND/XOR/OR/CP with a register
+                    if (instruction < 0xA0 || instruction > 0xBF || (instruction & 0x07) == 6)
+                        return 0;
+                    break;
+            }
+            if (address - head > max_idle_loop_bytes)
+                return 0;
+        }
+        return period >> speed_shift;
+    }
+
+    // Only scheduled events change these. The timer and APU registers are computed from the
+    // cycle counter when read, so they never are.
+    static bool pollable(std::uint16_t address)
+    {
+        return !(address >= Timer::DIV && address <= Timer::TAC) && !(address >= Apu::first_register && address <= Apu::last_address);
+    }
+
+    // The CB page is regular enough to decode from the opcode's fields instead of listing
+    // 256 cases: bits 0-2 pick the operand (B C D E H L (HL) A), bits 3-5 the operation
+    // or bit number, and bits 6-7 the group (rotate/shift, BIT, RES, SET).
+    void prefix_cb(std::uint8_t instruction)
+    {
+        const int operand = instruction & 0x07;
+        const int selector = (instruction >> 3) & 0x07;
+        const uint8_t value = read_operand(operand);
+        cycles += (operand == 6 ? (instruction >> 6 == 1 ? 8 : 12) : 4) >> speed_shift;
+
+        switch (instruction >> 6)
+        {
+            case 0:
+                write_operand(operand, rotate_or_shift(selector, value));
+                break;
+            case 1:
+                assign_flags((value & (1 << selector)) == 0, false, true, is_flag_set(Flags::carry));
+                break;
+            case 2:
+                write_operand(operand, value & ~(1 << selector));
+                break;
+            case 3:
+                write_operand(operand, value | (1 << selector));
+                break;
+        }
+    }
+
+    uint8_t rotate_or_shift(int operation, uint8_t value)
+    {
+        const int carry_in = is_flag_set(Flags::carry) ? 1 : 0;
+        uint8_t result{};
+        bool carry{};
+        switch (operation)
+        {
+            case 0: // RLC
+                result = (value << 1) | (value >> 7);
+                carry = (value & 0x80) != 0;
+                break;
+            case 1: // RRC
+                result = (value >> 1) | (value << 7);
+                carry = (value & 0x01) != 0;
+                break;
+            case 2: // RL
+                result = (value << 1) | carry_in;
+                carry = (value & 0x80) != 0;
+                break;
+            case 3: // RR
+                result = (value >> 1) | (carry_in << 7);
+                carry = (value & 0x01) != 0;
+                break;
+            case 4: // SLA
+                result = value << 1;
+                carry = (value & 0x80) != 0;
+                break;
+            case 5: // SRA
+                result = (value >> 1) | (value & 0x80);
+                carry = (value & 0x01) != 0;
+                break;
+            case 6: // SWAP
+                result = (value << 4) | (value >> 4);
+                break;
+            case 7: // SRL
+                result = value >> 1;
+                carry = (value & 0x01) != 0;
+                break;
+        }
+        assign_flags(result == 0, false, false, carry);
+        return result;
+    }
+
+    uint8_t read_operand(int operand)
+    {
+        switch (operand)
+        {
+            case 0: return get_upper(registers.BC);
+            case 1: return get_lower(registers.BC);
+            case 2: return get_upper(registers.DE);
+            case 3: return get_lower(registers.DE);
+            case 4: return get_upper(registers.HL);
+            case 5: return get_lower(registers.HL);
+            case 6: return read_from_memory(registers.HL);
+            default: return get_upper(registers.accumulator_and_flags);
+        }
+    }
+
+    void write_operand(int operand, uint8_t value)
+    {
+        switch (operand)
+        {
+            case 0: registers.BC = set_upper(registers.BC, value); break;
+            case 1: registers.BC = set_lower(registers.BC, value); break;
+            case 2: registers.DE = set_upper(registers.DE, value); break;
+            case 3: registers.DE = set_lower(registers.DE, value); break;
+            case 4: registers.HL = set_upper(registers.HL, value); break;
+            case 5: registers.HL = set_lower(registers.HL, value); break;
+            case 6: write_to_memory(registers.HL, value); break;
+            default: registers.accumulator_and_flags = set_upper(registers.accumulator_and_flags, value); break;
+        }
+    }
+
+    void add_to_HL(std::uint16_t value)
+    {
+        const int sum = registers.HL + value;
+        const bool zero = is_flag_set(Flags::zero);
+        assign_flags(zero, false, (registers.HL & 0xFFF) + (value & 0xFFF) > 0xFFF, sum > 0xFFFF);
+        registers.HL = static_cast<std::uint16_t>(sum);
+    }
+
+    // SP + r8 for ADD SP,r8 and LD HL,SP+r8: the flags come from the unsigned low-byte add.
+    std::uint16_t stack_pointer_plus_offset()
+    {
+        const std::uint8_t offset = read_from_memory(registers.program_counter++);
+        const std::uint16_t stack_pointer = registers.stack_pointer;
+        assign_flags(false, false, (stack_pointer & 0xF) + (offset & 0xF) > 0xF, (stack_pointer & 0xFF) + offset > 0xFF);
+        return static_cast<std::uint16_t>(stack_pointer + static_cast<std::int8_t>(offset));
+    }
+
+    void x16_Arithmetic_Logic_Unit(opcode instruction)
+    {
+        switch (instruction)
+        {
+            case opcode::INC_BC:
+            {
+                ++registers.BC;
+                break;
+            }
+            case opcode::ADD_HL_BC:
+            {
+                add_to_HL(registers.BC);
+                break;
+            }
+            case opcode::DEC_BC:
+            {
+                --registers.BC;
+                break;
+            }
+            case opcode::INC_DE:
+            {
+                ++registers.DE;
+                break;
+            }
+            case opcode::ADD_HL_DE:
+            {
+                add_to_HL(registers.DE);
+                break;
+            }
+            case opcode::DEC_DE:
+            {
+                --registers.DE;
+                break;
+            }
+            case opcode::INC_HL:
+            {
+                ++registers.HL;
+                break;
+            }
+            case opcode::ADD_HL_HL:
+            {
+                add_to_HL(registers.HL);
+                break;
+            }
+            case opcode::DEC_HL:
+            {
+                --registers.HL;
+                break;
+            }
+            case opcode::INC_SP:
+            {
+                ++registers.stack_pointer;
+                break;
+            }
+            case opcode::ADD_HL_SP:
+            {
+                add_to_HL(registers.stack_pointer);
+                break;
+            }
+            case opcode::DEC_SP:
+            {
+                --registers.stack_pointer;
+                break;
+            }
+            case opcode::ADD_SP_r8:
+            {
+                registers.stack_pointer = stack_pointer_plus_offset();
+                break;
+            }
         }
     }
 
@@ -1591,7 +3023,9 @@ public:
             }
             case opcode::LD_ia16_SP:
             {
-                
+                const std::uint16_t address = read_16b_value();
+                write_to_memory(address, get_lower(registers.stack_pointer));
+                write_to_memory(address + 1, get_upper(registers.stack_pointer));
                 break;
             }
             case opcode::LD_DE_d16:
@@ -1653,7 +3087,7 @@ public:
             }
             case opcode::POP_AF:
             {
-                registers.accumulator_and_flags = pop_from_stack();
+                registers.accumulator_and_flags = pop_from_stack() & 0xFFF0;
                 break;
             }
             case opcode::PUSH_AF:
@@ -1663,6 +3097,7 @@ public:
             }
             case opcode::LD_HL_SP_Offset:
             {
+                registers.HL = stack_pointer_plus_offset();
                 break;
             }
             case opcode::LD_SP_HL:
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct Cpu_state;
+
+using Break_condition = std::function<bool(const Cpu_state&)>;
+
+enum class Access
+{
+    read = 1,
+    write = 2,
+    read_write = 3
+};
+
+enum class Stop_reason
+{
+    none,
+    breakpoint,
+    watchpoint
+};
+
+struct Breakpoint
+{
+    std::uint16_t address{};
+    Break_condition condition;
+};
+
+struct Watchpoint
+{
+    std::uint16_t first{};
+    std::uint16_t last{};
+    Access access = Access::write;
+    Break_condition condition;
+};
+
+// Breakpoints and watchpoints cost nothing until they exist: Cpu_state unmaps only the
+// pages they touch, so the checks run on the slow memory path for those pages alone.
+struct Debugger
+{
+    std::vector<Breakpoint> breakpoints;
+    std::vector<Watchpoint> watchpoints;
+    bool pages_dirty = true;
+
+    Stop_reason stop_reason = Stop_reason::none;
+    std::uint16_t stop_address{};
+    Access stop_access = Access::read;
+    bool resuming = false;
+
+    void add_breakpoint(std::uint16_t address, Break_condition condition = {})
+    {
+        breakpoints.push_back({ address, std::move(condition) });
+        pages_dirty = true;
+    }
+
+    void remove_breakpoint(std::uint16_t address)
+    {
+        std::erase_if(breakpoints, [address](const Breakpoint& breakpoint) { return breakpoint.address == address; });
+        pages_dirty = true;
+    }
+
+    void add_watchpoint(std::uint16_t first, std::uint16_t last, Access access, Break_condition condition = {})
+    {
+        watchpoints.push_back({ first, last, access, std::move(condition) });
+        pages_dirty = true;
+    }
+
+    void remove_watchpoint(std::uint16_t first)
+    {
+        std::erase_if(watchpoints, [first](const Watchpoint& watchpoint) { return watchpoint.first == first; });
+        pages_dirty = true;
+    }
+
+    void clear()
+    {
+        breakpoints.clear();
+        watchpoints.clear();
+        pages_dirty = true;
+    }
+
+    bool breakpoint_on_page(std::uint8_t page) const
+    {
+        return std::any_of(breakpoints.begin(), breakpoints.end(), [page](const Breakpoint& breakpoint) { return (breakpoint.address >> 8) == page; });
+    }
+
+    bool watchpoint_on_page(std::uint8_t page, Access access) const
+    {
+        return std::any_of(watchpoints.begin(), watchpoints.end(), [page, access](const Watchpoint& watchpoint)
+        {
+            return (static_cast<int>(watchpoint.access) & static_cast<int>(access)) != 0
+                && (watchpoint.first >> 8) <= page && page <= (watchpoint.last >> 8);
+        });
+    }
+
+    void stop(Stop_reason reason, std::uint16_t address, Access access = Access::read)
+    {
+        stop_reason = reason;
+        stop_address = address;
+        stop_access = access;
+    }
+};
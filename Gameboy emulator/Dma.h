@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Scheduler.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+using Page_table = std::array<std::uint8_t*, 256>;
+
+// OAM DMA (0xFF46) and CGB HDMA (0xFF51-0xFF55). Transfers are block copies between the
+// backing pages of the bus. OAM DMA copies all 160 bytes at the start and keeps
+// oam_active set for the length of the transfer, which is when the CPU sees bus
+// conflicts; HDMA returns the dots the CPU is stalled for.
+struct Dma
+{
+    static constexpr std::uint16_t OAM_DMA = 0xFF46;
+    static constexpr std::uint16_t HDMA1 = 0xFF51;
+    static constexpr std::uint16_t HDMA2 = 0xFF52;
+    static constexpr std::uint16_t HDMA3 = 0xFF53;
+    static constexpr std::uint16_t HDMA4 = 0xFF54;
+    static constexpr std::uint16_t HDMA5 = 0xFF55;
+    static constexpr std::uint16_t oam_start = 0xFE00;
+    static constexpr std::size_t oam_size = 160;
+    static constexpr std::uint64_t oam_duration = 4 + oam_size * 4;
+    static constexpr std::size_t block_size = 16;
+    static constexpr std::uint64_t block_dots = 32;
+
+    std::uint8_t oam_source = 0xFF;
+    bool oam_active = false;
+    std::uint16_t hdma_source{};
+    std::uint16_t hdma_destination{};  // offset into VRAM
+    std::uint8_t hdma_blocks{};        // blocks left in an HBlank transfer, kept when it is cancelled
+    bool hblank_active = false;
+
+    void start_oam(std::uint8_t value, std::uint64_t now, const Page_table& pages, Scheduler& scheduler, std::uint8_t speed_shift)
+    {
+        oam_source = value;
+        // Sources above 0xDFFF read the echo of work RAM
+        const std::uint8_t page = value >= 0xE0 ? value - 0x20 : value;
+        std::memcpy(pages[oam_start >> 8], pages[page], oam_size);
+        oam_active = true;
+        scheduler.schedule(Event::oam_dma_end, now + (oam_duration >> speed_shift));
+    }
+
+    std::uint8_t read(std::uint16_t address) const
+    {
+        if (address == OAM_DMA)
+            return oam_source;
+        // Bit 7 is clear while an HBlank transfer runs; once one is cancelled it reads set
+        // over the blocks still left, which is how games resume the copy.
+        if (address == HDMA5)
+            return hdma_blocks == 0 ? 0xFF : (hblank_active ? 0x00 : 0x80) | (hdma_blocks - 1);
+        return 0xFF;
+    }
+
+    // Returns the dots the CPU is stalled for.
+    std::uint64_t write(std::uint16_t address, std::uint8_t value, const Page_table& pages, bool in_hblank)
+    {
+        switch (address)
+        {
+            case HDMA1: hdma_source = (hdma_source & 0x00FF) | (value << 8); break;
+            case HDMA2: hdma_source = (hdma_source & 0xFF00) | (value & 0xF0); break;
+            case HDMA3: hdma_destination = (hdma_destination & 0x00FF) | ((value & 0x1F) << 8); break;
+            case HDMA4: hdma_destination = (hdma_destination & 0xFF00) | (value & 0xF0); break;
+            case HDMA5:
+            {
+                const std::uint8_t blocks = (value & 0x7F) + 1;
+                if (hblank_active && (value & 0x80) == 0)
+                {
+                    hblank_active = false;
+                    break;
+                }
+                if ((value & 0x80) == 0)
+                {
+                    hdma_blocks = 0;
+                    for (std::uint8_t i = 0; i < blocks; ++i)
+                        copy_block(pages);
+                    return blocks * block_dots;
+                }
+                hdma_blocks = blocks;
+                hblank_active = true;
+                if (in_hblank)
+                    return hblank_block(pages);
+                break;
+            }
+            default: break;
+        }
+        return 0;
+    }
+
+    // One 16-byte block of an HBlank transfer; returns the stall in dots.
+    std::uint64_t hblank_block(const Page_table& pages)
+    {
+        copy_block(pages);
+        if (--hdma_blocks == 0)
+            hblank_active = false;
+        return block_dots;
+    }
+
+private:
+    // Blocks are 16-byte aligned at both ends, so a block never crosses a page.
+    void copy_block(const Page_table& pages)
+    {
+        const std::uint16_t destination = 0x8000 | hdma_destination;
+        std::memcpy(pages[destination >> 8] + (destination & 0xFF), pages[hdma_source >> 8] + (hdma_source & 0xFF), block_size);
+        hdma_source += block_size;
+        hdma_destination = (hdma_destination + block_size) & 0x1FF0;
+    }
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+struct Frame
+{
+    static constexpr std::size_t width = 160;
+    static constexpr std::size_t height = 144;
+
+    std::array<std::uint32_t, width * height> pixels{};
+    // Palette entry of each pixel: 0-31 BG (palette * 4 + colour), 32-63 OBJ
+    std::array<std::uint8_t, width * height> indices{};
+    // Luma of each palette entry as it stood when the frame was published
+    std::array<std::uint8_t, 64> luma{};
+    std::uint64_t sequence{};
+};
+
+struct Frame_view
+{
+    std::span<const std::uint32_t> pixels;
+    std::span<const std::uint8_t> indices;
+    std::span<const std::uint8_t> luma;
+    std::uint64_t sequence{};
+};
+
+// Triple-buffered handoff between the emulation thread and one consumer. The producer
+// always has a back buffer to render into and the consumer always holds a front buffer to
+// read; the third sits in the middle slot. Each side swaps its buffer with the middle using
+// one atomic exchange, so neither ever waits for the other. A consumer slower than the
+// emulator sees the latest frame and skips the ones in between.
+struct Frame_pipeline
+{
+    // Producer side
+    Frame& back_buffer()
+    {
+        return frames[back];
+    }
+
+    void publish(std::uint64_t sequence)
+    {
+        frames[back].sequence = sequence;
+        back = middle.exchange(back | fresh, std::memory_order_acq_rel) & index_mask;
+    }
+
+    // Consumer side
+    bool has_new_frame() const
+    {
+        return (middle.load(std::memory_order_acquire) & fresh) != 0;
+    }
+
+    // Latest published frame, without copying. The view stays valid until the next acquire();
+    // if nothing new was published it is the same frame as last time.
+    Frame_view acquire()
+    {
+        if (has_new_frame())
+            front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+        const Frame& frame = frames[front];
+        return { frame.pixels, frame.indices, frame.luma, frame.sequence };
+    }
+
+private:
+    static constexpr std::uint8_t index_mask = 0x03;
+    static constexpr std::uint8_t fresh = 0x04;
+
+    std::unique_ptr<Frame[]> frames = std::make_unique<Frame[]>(3);
+    std::uint8_t back = 0;
+    alignas(64) std::atomic<std::uint8_t> middle{ 1 };
+    alignas(64) std::uint8_t front = 2;
+};
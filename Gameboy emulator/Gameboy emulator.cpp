@@ -3,11 +3,20 @@
 #include <nlohmann/json.hpp>
 
 #include "Cpu_state.h"
+#include "Gdb_server.h"
 
 #include <array>
 #include <cstdint>
 #include <fstream>
+#include <iterator>
+#include <string>
 #include <unordered_map>
+#include <vector>
+
+#ifdef GB_COMPILED_ROM
+// Blocks of the ROM compiled ahead of time by tools/rom_recompiler
+extern const Compiled_rom GB_COMPILED_ROM;
+#endif
 
 
 void test_x8_arithmetic()
@@ -49,33 +58,106 @@ void test_x8_arithmetic()
 
 }
 
-int main()
+int main(int argc, char* argv[])
 {
     //test_x8_arithmetic();   
+
+    std::string rom_path = R"(C:\Users\Michael\Downloads\gb-test-roms-master\gb-test-roms-master\cpu_instrs\individual\06-ld r,r.gb)";
+    int gdb_port = 0;
+    std::string link_listen;
+    std::string link_connect;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        if (argument == "--gdb" && i + 1 < argc)
+            gdb_port = std::stoi(argv[++i]);
+        else if (argument == "--link-listen" && i + 1 < argc)
+            link_listen = argv[++i];
+        else if (argument == "--link-connect" && i + 1 < argc)
+            link_connect = argv[++i];
+        else
+            rom_path = argument;
+    }
    
-    std::ifstream in{R"(C:\Users\Michael\Downloads\gb-test-roms-master\gb-test-roms-master\cpu_instrs\individual\06-ld r,r.gb)"};
+    std::ifstream in{rom_path, std::ios::binary};
    
     if(!in) std::cerr<<"Failed to load file\n";
 
     Cpu_state cpu_state;
     {
-        int pos = 0x0;
-        while(in.read(reinterpret_cast<char*>(&cpu_state.memory[pos++]),1));
+        const std::vector<std::uint8_t> rom{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+        cpu_state.load_rom(rom.data(), rom.size());
     }    
+#ifdef GB_COMPILED_ROM
+    if (!cpu_state.attach_compiled_rom(&GB_COMPILED_ROM))
+        std::cerr << "The compiled blocks are for another ROM; interpreting it\n";
+#endif
 
     cpu_state.registers.program_counter = 0x100;
-    int i = 0;
-    while(true)
-    {
-        //std::cout<<std::hex<<"Instruction at address "<<cpu_state.registers.program_counter<<" is "<<static_cast<int>(cpu_state.memory[cpu_state.registers.program_counter])<<'\n';
-        cpu_state.run(opcode{ cpu_state.memory[cpu_state.registers.program_counter++] });
+    cpu_state.serial_output = &std::cout;
 
-        if(i==0)
-            std::cin>>i;
+    // Link cable to another process over a Unix domain socket
+    Link_port link;
+    if (!link_listen.empty() || !link_connect.empty())
+    {
+        if (link_listen.empty() ? link.connect(link_connect) : link.listen(link_listen))
+            cpu_state.attach_link(&link);
         else
-            --i;
-        //char c;
-        //std::cin>>c;
+            std::cerr << "Failed to open the link cable\n";
+    }
+
+    if (gdb_port != 0)
+    {
+        Gdb_server gdb_server{ static_cast<std::uint16_t>(gdb_port) };
+        gdb_server.serve(cpu_state);
+        return 0;
+    }
+
+    Debugger debugger;
+    cpu_state.attach_debugger(&debugger);
 
+    // s <count>: step, c: continue, b <addr>: breakpoint, r/w <first> <last>: watchpoint, d <addr>: delete
+    std::string command;
+    while(std::cin >> command)
+    {
+        if (command == "s")
+        {
+            int count = 1;
+            std::cin >> count;
+            if (debugger.pages_dirty)
+                cpu_state.map_pages();
+            for (int i = 0; i < count; ++i)
+            {
+                //std::cout<<std::hex<<"Instruction at address "<<cpu_state.registers.program_counter<<" is "<<static_cast<int>(cpu_state.memory[cpu_state.registers.program_counter])<<'\n';
+                cpu_state.step();
+                cpu_state.dispatch_events();
+            }
+        }
+        else if (command == "c")
+        {
+            do
+                cpu_state.run_for(70224);
+            while (debugger.stop_reason == Stop_reason::none);
+        }
+        else if (command == "b")
+        {
+            std::uint16_t address;
+            std::cin >> std::hex >> address >> std::dec;
+            debugger.add_breakpoint(address);
+        }
+        else if (command == "r" || command == "w")
+        {
+            std::uint16_t first, last;
+            std::cin >> std::hex >> first >> last >> std::dec;
+            debugger.add_watchpoint(first, last, command == "r" ? Access::read : Access::write);
+        }
+        else if (command == "d")
+        {
+            std::uint16_t address;
+            std::cin >> std::hex >> address >> std::dec;
+            debugger.remove_breakpoint(address);
+            debugger.remove_watchpoint(address);
+        }
+        std::cout << std::hex << "PC " << cpu_state.registers.program_counter << std::dec << '\n';
     }
 }
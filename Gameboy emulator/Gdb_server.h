@@ -0,0 +1,456 @@
+#pragma once
+
+#include "Cpu_state.h"
+#include "Debugger.h"
+#include "Spsc_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// GDB remote serial protocol stub on a local TCP port. The socket thread only frames and
+// acknowledges packets; everything touching the Cpu_state happens on the emulation thread,
+// which drains the request queue once per slice, so an idle debugger costs one queue check
+// per frame.
+struct Gdb_server
+{
+#ifdef _WIN32
+    using socket_handle = SOCKET;
+    static constexpr socket_handle invalid_socket = INVALID_SOCKET;
+#else
+    using socket_handle = int;
+    static constexpr socket_handle invalid_socket = -1;
+#endif
+
+    static constexpr std::uint64_t slice_cycles = 70224;
+    static constexpr std::uint16_t register_count = 6;
+    static constexpr std::size_t packet_size = 0x1000;  // "PacketSize=1000" in qSupported, which is hex
+    static constexpr std::size_t max_read = (packet_size - 4) / 2;  // hex bytes between '$' and "#xx"
+
+    explicit Gdb_server(std::uint16_t port)
+    {
+#ifdef _WIN32
+        WSADATA data;
+        WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listener == invalid_socket
+            || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(listener, 1) != 0)
+        {
+            std::cerr << "Failed to listen for gdb on port " << port << '\n';
+            finished = true;
+            return;
+        }
+        network_thread = std::thread{ [this] { network_loop(); } };
+    }
+
+    ~Gdb_server()
+    {
+        finished = true;
+        if (network_thread.joinable())
+            network_thread.join();
+        close_socket(client);
+        close_socket(listener);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    Gdb_server(const Gdb_server&) = delete;
+    Gdb_server& operator=(const Gdb_server&) = delete;
+
+    // Emulation side. Returns once gdb detaches, kills the session or disconnects.
+    void serve(Cpu_state& cpu_state)
+    {
+        Debugger debugger;
+        cpu_state.attach_debugger(&debugger);
+        bool running = false;
+        std::string packet;
+
+        while (!finished)
+        {
+            if (running)
+            {
+                cpu_state.run_for(slice_cycles);
+                if (debugger.stop_reason != Stop_reason::none)
+                {
+                    running = false;
+                    reply(stop_reply(debugger));
+                }
+            }
+            else if (requests.empty())
+                std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+
+            while (requests.pop(packet))
+            {
+                try
+                {
+                    if (auto response = handle(cpu_state, debugger, packet, running))
+                        reply(std::move(*response));
+                }
+                catch (const std::logic_error&)
+                {
+                    reply("E01");
+                }
+            }
+            if (detaching)
+                finished = true;
+        }
+        cpu_state.attach_debugger(nullptr);
+    }
+
+private:
+    Spsc_queue<std::string, 64> requests;
+    Spsc_queue<std::string, 64> replies;
+    std::atomic<bool> finished{ false };
+    bool detaching = false;
+    std::thread network_thread;
+    socket_handle listener = invalid_socket;
+    socket_handle client = invalid_socket;
+
+    // gdb waits for every reply, so a full queue is waited out while the socket thread sends
+    // rather than dropping one. Gives up once the session is over.
+    void reply(std::string text)
+    {
+        while (!replies.push(text) && !finished)
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+    }
+
+    static void close_socket(socket_handle handle)
+    {
+        if (handle == invalid_socket)
+            return;
+#ifdef _WIN32
+        closesocket(handle);
+#else
+        close(handle);
+#endif
+    }
+
+    static int wait_readable(socket_handle handle, int timeout_ms)
+    {
+        pollfd descriptor{};
+        descriptor.fd = handle;
+        descriptor.events = POLLIN;
+#ifdef _WIN32
+        return WSAPoll(&descriptor, 1, timeout_ms);
+#else
+        return poll(&descriptor, 1, timeout_ms);
+#endif
+    }
+
+    void send_text(const std::string& text)
+    {
+#ifdef MSG_NOSIGNAL
+        send(client, text.data(), text.size(), MSG_NOSIGNAL);
+#else
+        send(client, text.data(), static_cast<int>(text.size()), 0);
+#endif
+    }
+
+    void network_loop()
+    {
+        while (!finished && wait_readable(listener, 10) <= 0);
+        if (finished)
+            return;
+        client = accept(listener, nullptr, nullptr);
+
+        std::string incoming;
+        char buffer[1024];
+        std::string reply;
+        while (!finished)
+        {
+            if (wait_readable(client, 5) > 0)
+            {
+                const auto received = recv(client, buffer, sizeof(buffer), 0);
+                if (received <= 0)
+                {
+                    requests.push("k");
+                    finished = true;  // nothing will drain replies any more
+                    return;
+                }
+                incoming.append(buffer, received);
+                parse_packets(incoming);
+            }
+            while (replies.pop(reply))
+                send_text(frame(reply));
+        }
+        while (replies.pop(reply))
+            send_text(frame(reply));
+    }
+
+    void parse_packets(std::string& incoming)
+    {
+        while (!incoming.empty())
+        {
+            // Between packets there are acks ('+' or '-') and interrupts ('\x03'), which can
+            // share a read with each other and with packets; anything else is dropped.
+            if (incoming.front() != '$')
+            {
+                if (incoming.front() == '\x03')
+                    requests.push("\x03");
+                incoming.erase(0, 1);
+                continue;
+            }
+            const auto end = incoming.find('#');
+            if (end == std::string::npos || end + 2 >= incoming.size())
+                return;
+            const auto body = incoming.substr(1, end - 1);
+            const bool valid = std::strtoul(incoming.substr(end + 1, 2).c_str(), nullptr, 16) == checksum(body);
+            incoming.erase(0, end + 3);
+            send_text(valid ? "+" : "-");
+            if (valid)
+                requests.push(body);
+        }
+    }
+
+    static std::uint8_t checksum(const std::string& body)
+    {
+        std::uint8_t sum = 0;
+        for (const char c : body)
+            sum += static_cast<std::uint8_t>(c);
+        return sum;
+    }
+
+    static std::string frame(const std::string& body)
+    {
+        char trailer[4];
+        std::snprintf(trailer, sizeof(trailer), "#%02x", checksum(body));
+        return '$' + body + trailer;
+    }
+
+    static std::string to_hex(std::uint8_t value)
+    {
+        constexpr char digits[] = "0123456789abcdef";
+        return { digits[value >> 4], digits[value & 0xF] };
+    }
+
+    // Registers go out as af, bc, de, hl, sp, pc; 16 bits each, little-endian. index must be
+    // below register_count.
+    static std::uint16_t& register_at(Cpu_state& cpu_state, std::size_t index)
+    {
+        auto& registers = cpu_state.registers;
+        std::uint16_t* const order[register_count] =
+        {
+            &registers.accumulator_and_flags, &registers.BC, &registers.DE,
+            &registers.HL, &registers.stack_pointer, &registers.program_counter
+        };
+        return *order[index];
+    }
+
+    static std::string register_hex(std::uint16_t value)
+    {
+        return to_hex(value & 0xFF) + to_hex(value >> 8);
+    }
+
+    static std::uint16_t parse_register(const std::string& hex)
+    {
+        const auto value = std::stoul(hex, nullptr, 16);
+        return static_cast<std::uint16_t>(((value & 0xFF) << 8) | ((value >> 8) & 0xFF));
+    }
+
+    static std::string stop_reply(const Debugger& debugger)
+    {
+        if (debugger.stop_reason != Stop_reason::watchpoint)
+            return "S05";
+        const char* kind = debugger.stop_access == Access::write ? "watch" : "rwatch";
+        char address[5];
+        std::snprintf(address, sizeof(address), "%04x", debugger.stop_address);
+        return std::string{ "T05" } + kind + ':' + address + ';';
+    }
+
+    static std::string target_description()
+    {
+        return R"(<?xml version="1.0"?><!DOCTYPE target SYSTEM "gdb-target.dtd">)"
+            R"(<target version="1.0"><architecture>z80</architecture><feature name="org.gnu.gdb.z80.cpu">)"
+            R"(<reg name="af" bitsize="16" type="int"/><reg name="bc" bitsize="16" type="int"/>)"
+            R"(<reg name="de" bitsize="16" type="int"/><reg name="hl" bitsize="16" type="int"/>)"
+            R"(<reg name="sp" bitsize="16" type="data_ptr"/><reg name="pc" bitsize="16" type="code_ptr"/>)"
+            R"(</feature></target>)";
+    }
+
+    std::optional<std::string> handle(Cpu_state& cpu_state, Debugger& debugger, const std::string& packet, bool& running)
+    {
+        switch (packet.empty() ? '\0' : packet.front())
+        {
+            case '\x03':
+            {
+                running = false;
+                return "S02";
+            }
+            case '?':
+            {
+                return "S05";
+            }
+            case 'g':
+            {
+                std::string reply;
+                for (std::size_t i = 0; i < register_count; ++i)
+                    reply += register_hex(register_at(cpu_state, i));
+                return reply;
+            }
+            case 'G':
+            {
+                if (packet.size() < 1 + register_count * 4)
+                    return "E00";
+                for (std::size_t i = 0; i < register_count; ++i)
+                    register_at(cpu_state, i) = parse_register(packet.substr(1 + i * 4, 4));
+                return "OK";
+            }
+            case 'p':
+            {
+                const auto index = std::stoul(packet.substr(1), nullptr, 16);
+                if (index >= register_count)
+                    return "E00";
+                return register_hex(register_at(cpu_state, index));
+            }
+            case 'P':
+            {
+                const auto equals = packet.find('=');
+                const auto index = std::stoul(packet.substr(1, equals - 1), nullptr, 16);
+                if (equals == std::string::npos || index >= register_count)
+                    return "E00";
+                register_at(cpu_state, index) = parse_register(packet.substr(equals + 1));
+                return "OK";
+            }
+            case 'm':
+            {
+                const auto comma = packet.find(',');
+                const auto address = std::stoul(packet.substr(1, comma - 1), nullptr, 16);
+                const auto length = std::stoul(packet.substr(comma + 1), nullptr, 16);
+                if (length > max_read)
+                    return "E01";
+                std::string reply;
+                for (std::size_t i = 0; i < length; ++i)
+                    reply += to_hex(cpu_state.peek(static_cast<std::uint16_t>(address + i)));
+                return reply;
+            }
+            case 'M':
+            {
+                const auto comma = packet.find(',');
+                const auto colon = packet.find(':');
+                const auto address = std::stoul(packet.substr(1, comma - 1), nullptr, 16);
+                const auto length = std::stoul(packet.substr(comma + 1, colon - comma - 1), nullptr, 16);
+                for (std::size_t i = 0; i < length && colon + 1 + i * 2 + 2 <= packet.size(); ++i)
+                    cpu_state.poke(static_cast<std::uint16_t>(address + i), static_cast<std::uint8_t>(std::stoul(packet.substr(colon + 1 + i * 2, 2), nullptr, 16)));
+                return "OK";
+            }
+            case 'c':
+            {
+                if (packet.size() > 1)
+                    cpu_state.registers.program_counter = static_cast<std::uint16_t>(std::stoul(packet.substr(1), nullptr, 16));
+                running = true;
+                return std::nullopt;
+            }
+            case 's':
+            {
+                if (packet.size() > 1)
+                    cpu_state.registers.program_counter = static_cast<std::uint16_t>(std::stoul(packet.substr(1), nullptr, 16));
+                if (debugger.pages_dirty)
+                    cpu_state.map_pages();
+                cpu_state.step();
+                cpu_state.dispatch_events();
+                return "S05";
+            }
+            case 'Z':
+            case 'z':
+            {
+                const auto first_comma = packet.find(',');
+                const auto second_comma = packet.find(',', first_comma + 1);
+                const auto address = static_cast<std::uint16_t>(std::stoul(packet.substr(first_comma + 1, second_comma - first_comma - 1), nullptr, 16));
+                const auto length = std::stoul(packet.substr(second_comma + 1), nullptr, 16);
+                const auto last = static_cast<std::uint16_t>(address + (length > 0 ? length - 1 : 0));
+                const bool insert = packet.front() == 'Z';
+                switch (packet[1])
+                {
+                    case '0':
+                    case '1':
+                        insert ? debugger.add_breakpoint(address) : debugger.remove_breakpoint(address);
+                        break;
+                    case '2':
+                        insert ? debugger.add_watchpoint(address, last, Access::write) : debugger.remove_watchpoint(address);
+                        break;
+                    case '3':
+                        insert ? debugger.add_watchpoint(address, last, Access::read) : debugger.remove_watchpoint(address);
+                        break;
+                    case '4':
+                        insert ? debugger.add_watchpoint(address, last, Access::read_write) : debugger.remove_watchpoint(address);
+                        break;
+                    default:
+                        return "";
+                }
+                return "OK";
+            }
+            case 'q':
+            {
+                if (packet.rfind("qSupported", 0) == 0)
+                    return "PacketSize=1000;qXfer:features:read+";
+                if (packet == "qAttached")
+                    return "1";
+                if (packet == "qC")
+                    return "QC1";
+                if (packet == "qfThreadInfo")
+                    return "m1";
+                if (packet == "qsThreadInfo")
+                    return "l";
+                if (packet.rfind("qXfer:features:read:target.xml:", 0) == 0)
+                {
+                    const auto arguments = packet.substr(31);
+                    const auto comma = arguments.find(',');
+                    const auto offset = std::stoul(arguments.substr(0, comma), nullptr, 16);
+                    const auto length = std::stoul(arguments.substr(comma + 1), nullptr, 16);
+                    const auto description = target_description();
+                    if (offset >= description.size())
+                        return "l";
+                    const auto chunk = description.substr(offset, length);
+                    return (offset + chunk.size() < description.size() ? "m" : "l") + chunk;
+                }
+                return "";
+            }
+            case 'H':
+            case 'T':
+            {
+                return "OK";
+            }
+            case 'D':
+            {
+                detaching = true;
+                return "OK";
+            }
+            case 'k':
+            {
+                detaching = true;
+                return std::nullopt;
+            }
+            default:
+                return "";
+        }
+    }
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+// IE (0xFFFF), IF (0xFF0F) and IME. pending is kept up to date on every change so the
+// CPU tests a single bool per instruction; it also covers the states that need a look
+// before the next fetch (EI delay, HALT, the HALT bug).
+struct Interrupts
+{
+    static constexpr std::uint16_t IF = 0xFF0F;
+    static constexpr std::uint16_t IE = 0xFFFF;
+    static constexpr std::uint16_t first_vector = 0x40;
+
+    static constexpr std::uint8_t vblank = 0x01;
+    static constexpr std::uint8_t stat = 0x02;
+    static constexpr std::uint8_t timer = 0x04;
+    static constexpr std::uint8_t serial = 0x08;
+    static constexpr std::uint8_t joypad = 0x10;
+    static constexpr std::uint8_t all = 0x1F;
+
+    std::uint8_t enable{};
+    std::uint8_t flags = vblank;  // IF after the boot ROM
+    bool master{};
+    bool enable_delay{};  // EI takes effect after the following instruction
+    bool halted{};
+    bool halt_bug{};
+    bool pending{};
+
+    std::uint8_t requested() const
+    {
+        return enable & flags & all;
+    }
+
+    void request(std::uint8_t interrupt)
+    {
+        flags |= interrupt;
+        update();
+    }
+
+    void update()
+    {
+        pending = enable_delay || halted || halt_bug || (master && requested() != 0);
+    }
+
+    std::uint8_t read(std::uint16_t address) const
+    {
+        return address == IE ? enable : flags | 0xE0;
+    }
+
+    void write(std::uint16_t address, std::uint8_t value)
+    {
+        if (address == IE)
+            enable = value;
+        else
+            flags = value & all;
+        update();
+    }
+};
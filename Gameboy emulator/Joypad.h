@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+// P1 (0xFF00). buttons holds the pressed state, one bit per button, 1 = pressed.
+struct Joypad
+{
+    static constexpr std::uint16_t P1 = 0xFF00;
+
+    enum Button : std::uint8_t
+    {
+        right = 0x01,
+        left = 0x02,
+        up = 0x04,
+        down = 0x08,
+        a = 0x10,
+        b = 0x20,
+        select = 0x40,
+        start = 0x80
+    };
+
+    std::uint8_t selection = 0x30;  // bit 4 low: directions, bit 5 low: buttons
+    std::uint8_t buttons{};
+
+    std::uint8_t read() const
+    {
+        std::uint8_t lines = 0x0F;
+        if ((selection & 0x10) == 0)
+            lines &= ~buttons & 0x0F;
+        if ((selection & 0x20) == 0)
+            lines &= ~(buttons >> 4) & 0x0F;
+        return 0xC0 | selection | lines;
+    }
+
+    void write(std::uint8_t value)
+    {
+        selection = value & 0x30;
+    }
+
+    // Returns true if a selected line went low, which requests the joypad interrupt.
+    bool set_buttons(std::uint8_t pressed)
+    {
+        const std::uint8_t before = read();
+        buttons = pressed;
+        return (before & ~read() & 0x0F) != 0;
+    }
+};
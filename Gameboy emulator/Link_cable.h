@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Cpu_state.h"
+#include "Link_port.h"
+#include "Serial.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Two instances in one process joined by a link cable and run from one thread. Whichever is
+// behind runs next, up to quantum dots past the other, and nothing else is synchronised.
+// Since the quantum is the length of a transfer, a byte sent by one side always reaches the
+// other before that side's clock passes the end of the transfer, so exchanges land where
+// they would on hardware and runs are deterministic. (CGB fast-clock transfers are shorter
+// and can land up to a quantum late.) A side that reaches the end of its transfer before the
+// other has answered stops, and the other runs.
+struct Link_cable
+{
+    static constexpr std::uint64_t quantum = Serial::transfer_dots;
+
+    Link_cable(Cpu_state& a, Cpu_state& b)
+        : sides{ &a, &b }
+    {
+        Link_port::connect(ports[0], ports[1]);
+        a.attach_link(&ports[0]);
+        b.attach_link(&ports[1]);
+    }
+
+    Link_cable(const Link_cable&) = delete;
+    Link_cable& operator=(const Link_cable&) = delete;
+
+    ~Link_cable()
+    {
+        for (Cpu_state* side : sides)
+            side->attach_link(nullptr);
+    }
+
+    // Runs both instances for at least cycle_count dots each.
+    void run_for(std::uint64_t cycle_count)
+    {
+        const std::array<std::uint64_t, 2> ends{ time(0) + cycle_count, time(1) + cycle_count };
+        std::size_t stalled = sides.size();
+        while (time(0) < ends[0] || time(1) < ends[1])
+        {
+            std::size_t side = time(0) <= time(1) ? 0 : 1;
+            if (side == stalled)
+                side = 1 - side;
+            const std::uint64_t start = time(side);
+            const std::uint64_t end = time(1 - side) + quantum;
+            sides[side]->poll_link();
+            sides[side]->run_for(std::max<std::uint64_t>(end, start + 1) - start);
+            stalled = time(side) == start ? side : sides.size();
+        }
+    }
+
+    // Link time of a side: dots since the cable was plugged in.
+    std::uint64_t time(std::size_t side) const
+    {
+        return sides[side]->cycles - ports[side].base;
+    }
+
+private:
+    std::array<Cpu_state*, 2> sides;
+    std::array<Link_port, 2> ports;
+};
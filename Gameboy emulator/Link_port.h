@@ -0,0 +1,235 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Times are link time: dots since the link was made, so the two sides need not agree on
+// their own cycle counts.
+struct Link_message
+{
+    enum Kind : std::uint8_t
+    {
+        transfer,  // the sender started a transfer on its clock; it ends at `at`
+        reply,     // the receiver's side of the transfer that ended at `at`
+        time       // the sender has run up to `at`
+    };
+
+    Kind kind{};
+    std::uint8_t data{};
+    std::uint64_t at{};
+};
+
+// One end of a link cable. Two ports in one process are joined with connect(a, b) and post
+// straight into each other's inbox; both instances are then run from one thread by
+// Link_cable, which stops either one from getting too far ahead. A port can instead reach
+// another process over a Unix domain socket. Then each side runs freely, reports its time
+// every sync_interval dots and only blocks when it is more than max_lead dots ahead of the
+// other or needs the other's byte to finish a transfer.
+struct Link_port
+{
+#ifdef _WIN32
+    using socket_handle = SOCKET;
+    static constexpr socket_handle invalid_socket = INVALID_SOCKET;
+#else
+    using socket_handle = int;
+    static constexpr socket_handle invalid_socket = -1;
+#endif
+
+    static constexpr std::uint64_t default_sync_interval = 70224 / 4;
+    static constexpr std::uint64_t default_max_lead = 70224;
+
+    Link_port* peer{};
+    socket_handle socket = invalid_socket;
+    std::deque<Link_message> inbox;
+    std::uint64_t base{};  // local cycle at link time 0
+    std::uint64_t peer_time{};
+    std::optional<std::uint8_t> reply;  // the other side's byte for the transfer in flight
+    std::uint64_t sync_interval = default_sync_interval;
+    std::uint64_t max_lead = default_max_lead;  // at least sync_interval
+
+    Link_port()
+    {
+#ifdef _WIN32
+        WSADATA data;
+        WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+    }
+
+    Link_port(const Link_port&) = delete;
+    Link_port& operator=(const Link_port&) = delete;
+
+    ~Link_port()
+    {
+        disconnect();
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    static void connect(Link_port& a, Link_port& b)
+    {
+        a.peer = &b;
+        b.peer = &a;
+    }
+
+    // Creates the socket at path and waits for the other process to connect.
+    bool listen(const std::string& path)
+    {
+        sockaddr_un address{};
+        if (!make_address(path, address))
+            return false;
+        std::remove(path.c_str());
+        const socket_handle listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == invalid_socket)
+            return false;
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 && ::listen(listener, 1) == 0)
+            socket = accept(listener, nullptr, nullptr);
+        close_socket(listener);
+        std::remove(path.c_str());
+        return socket != invalid_socket;
+    }
+
+    bool connect(const std::string& path)
+    {
+        sockaddr_un address{};
+        if (!make_address(path, address))
+            return false;
+        socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socket != invalid_socket && ::connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+            disconnect();
+        return socket != invalid_socket;
+    }
+
+    void disconnect()
+    {
+        if (peer)
+            peer->peer = nullptr;
+        peer = nullptr;
+        close_socket(socket);
+        socket = invalid_socket;
+    }
+
+    bool connected() const
+    {
+        return peer || socket != invalid_socket;
+    }
+
+    bool remote() const
+    {
+        return socket != invalid_socket;
+    }
+
+    void send(const Link_message& message)
+    {
+        if (peer)
+            peer->inbox.push_back(message);
+        else if (remote())
+        {
+            std::array<char, packet_size> packet{};
+            std::memcpy(packet.data(), &message, sizeof(message));
+            if (::send(socket, packet.data(), static_cast<int>(packet.size()), send_flags) != static_cast<int>(packet.size()))
+                disconnect();
+        }
+    }
+
+    bool receive(Link_message& message)
+    {
+        if (inbox.empty() && remote())
+            read_socket(false);
+        if (inbox.empty())
+            return false;
+        message = inbox.front();
+        inbox.pop_front();
+        return true;
+    }
+
+    // Over a socket: blocks until a message arrives or the other side goes away.
+    void wait()
+    {
+        read_socket(true);
+    }
+
+private:
+    static constexpr std::size_t packet_size = 16;
+    static_assert(sizeof(Link_message) <= packet_size);
+
+#ifdef MSG_NOSIGNAL
+    static constexpr int send_flags = MSG_NOSIGNAL;
+#else
+    static constexpr int send_flags = 0;
+#endif
+
+    std::array<char, packet_size * 64> buffer{};
+    std::size_t buffered{};
+
+    static bool make_address(const std::string& path, sockaddr_un& address)
+    {
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    static void close_socket(socket_handle handle)
+    {
+        if (handle == invalid_socket)
+            return;
+#ifdef _WIN32
+        closesocket(handle);
+#else
+        close(handle);
+#endif
+    }
+
+    // Moves whatever has arrived into the inbox, first waiting for a message if block.
+    void read_socket(bool block)
+    {
+        while (remote())
+        {
+            pollfd descriptor{};
+            descriptor.fd = socket;
+            descriptor.events = POLLIN;
+#ifdef _WIN32
+            const int ready = WSAPoll(&descriptor, 1, block && inbox.empty() ? -1 : 0);
+#else
+            const int ready = poll(&descriptor, 1, block && inbox.empty() ? -1 : 0);
+#endif
+            if (ready <= 0)
+                return;
+            const auto received = recv(socket, buffer.data() + buffered, static_cast<int>(buffer.size() - buffered), 0);
+            if (received <= 0)
+            {
+                disconnect();
+                return;
+            }
+            buffered += received;
+            std::size_t offset = 0;
+            for (; buffered - offset >= packet_size; offset += packet_size)
+            {
+                Link_message message;
+                std::memcpy(&message, buffer.data() + offset, sizeof(message));
+                inbox.push_back(message);
+            }
+            std::memmove(buffer.data(), buffer.data() + offset, buffered - offset);
+            buffered -= offset;
+        }
+    }
+};
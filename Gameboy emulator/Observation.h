@@ -0,0 +1,165 @@
+#pragma once
+
+#include "Frame_pipeline.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GB_OBSERVATION_SSE2
+#endif
+
+// Grayscale observations for learning agents, straight from a frame's palette-index plane:
+// each source row is turned into luma through the frame's 64-entry table, then area-averaged
+// into the output. The RGB pixels are never touched and nothing is allocated after
+// construction. Exact halving (80x72) takes an SSE2 path; other sizes (84x84) use
+// precomputed per-axis coverage weights, so every output pixel is the true mean of the
+// source area it covers.
+struct Observer
+{
+    struct Span
+    {
+        std::size_t first{};
+        std::vector<std::uint32_t> weights;
+    };
+
+    std::size_t width;
+    std::size_t height;
+    std::vector<Span> columns;
+    std::vector<Span> rows;
+    std::vector<std::uint32_t> sums;
+
+    Observer(std::size_t width_, std::size_t height_)
+        : width{ width_ }, height{ height_ }, columns{ spans(Frame::width, width_) }, rows{ spans(Frame::height, height_) }, sums(width_)
+    {
+    }
+
+    // Writes width * height bytes to out.
+    void observe(const Frame_view& frame, std::uint8_t* out)
+    {
+        if (width * 2 == Frame::width && height * 2 == Frame::height)
+            observe_halved(frame, out);
+        else
+            observe_area(frame, out);
+    }
+
+private:
+    using Luma_row = std::array<std::uint8_t, Frame::width>;
+
+    // Output i covers source [i * source / output, (i + 1) * source / output); weights are
+    // overlaps measured in 1/output of a source pixel and add up to source.
+    static std::vector<Span> spans(std::size_t source, std::size_t output)
+    {
+        std::vector<Span> result(output);
+        for (std::size_t i = 0; i < output; ++i)
+        {
+            const std::size_t begin = i * source;
+            const std::size_t end = begin + source;
+            result[i].first = begin / output;
+            for (std::size_t j = result[i].first; j * output < end; ++j)
+            {
+                const std::size_t overlap = std::min(end, (j + 1) * output) - std::max(begin, j * output);
+                result[i].weights.push_back(static_cast<std::uint32_t>(overlap));
+            }
+        }
+        return result;
+    }
+
+    static void to_luma(const Frame_view& frame, std::size_t y, Luma_row& row)
+    {
+        const std::uint8_t* indices = &frame.indices[y * Frame::width];
+        for (std::size_t x = 0; x < Frame::width; ++x)
+            row[x] = frame.luma[indices[x] & 0x3F];
+    }
+
+    void observe_area(const Frame_view& frame, std::uint8_t* out)
+    {
+        const std::uint32_t divisor = static_cast<std::uint32_t>(Frame::width * Frame::height);
+        Luma_row row;
+        for (std::size_t y = 0; y < height; ++y)
+        {
+            std::fill(sums.begin(), sums.end(), 0);
+            const Span& vertical = rows[y];
+            for (std::size_t j = 0; j < vertical.weights.size(); ++j)
+            {
+                to_luma(frame, vertical.first + j, row);
+                for (std::size_t x = 0; x < width; ++x)
+                {
+                    const Span& horizontal = columns[x];
+                    std::uint32_t sum = 0;
+                    for (std::size_t i = 0; i < horizontal.weights.size(); ++i)
+                        sum += horizontal.weights[i] * row[horizontal.first + i];
+                    sums[x] += sum * vertical.weights[j];
+                }
+            }
+            for (std::size_t x = 0; x < width; ++x)
+                out[y * width + x] = static_cast<std::uint8_t>((sums[x] + divisor / 2) / divisor);
+        }
+    }
+
+    void observe_halved(const Frame_view& frame, std::uint8_t* out)
+    {
+        Luma_row top;
+        Luma_row bottom;
+        for (std::size_t y = 0; y < height; ++y)
+        {
+            to_luma(frame, y * 2, top);
+            to_luma(frame, y * 2 + 1, bottom);
+            std::uint8_t* line = out + y * width;
+            std::size_t x = 0;
+#ifdef GB_OBSERVATION_SSE2
+            const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+            const __m128i rounding = _mm_set1_epi16(2);
+            for (; x + 8 <= width; x += 8)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&top[x * 2]));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&bottom[x * 2]));
+                __m128i sum = _mm_add_epi16(_mm_and_si128(a, low_bytes), _mm_srli_epi16(a, 8));
+                sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_and_si128(b, low_bytes), _mm_srli_epi16(b, 8)));
+                sum = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(line + x), _mm_packus_epi16(sum, sum));
+            }
+#endif
+            for (; x < width; ++x)
+                line[x] = static_cast<std::uint8_t>((top[x * 2] + top[x * 2 + 1] + bottom[x * 2] + bottom[x * 2 + 1] + 2) / 4);
+        }
+    }
+};
+
+// The last depth observations, kept in caller-owned memory of depth * size bytes. Observe
+// into next() and then push(); the oldest slot is overwritten, nothing is shifted or copied.
+struct Frame_stack
+{
+    std::uint8_t* storage;
+    std::size_t size;
+    std::size_t depth;
+    std::size_t newest = 0;
+    std::size_t count = 0;
+
+    Frame_stack(std::uint8_t* storage_, std::size_t size_, std::size_t depth_)
+        : storage{ storage_ }, size{ size_ }, depth{ depth_ }, newest{ depth_ - 1 }
+    {
+    }
+
+    std::uint8_t* next() const
+    {
+        return storage + (newest + 1) % depth * size;
+    }
+
+    void push()
+    {
+        newest = (newest + 1) % depth;
+        count = std::min(count + 1, depth);
+    }
+
+    // age 0 is the newest observation
+    std::span<const std::uint8_t> get(std::size_t age) const
+    {
+        return { storage + (newest + depth - age % depth) % depth * size, size };
+    }
+};
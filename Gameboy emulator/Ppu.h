@@ -0,0 +1,388 @@
+#pragma once
+
+#include "Interrupts.h"
+#include "Scheduler.h"
+#include "Sprite_lists.h"
+#include "Tile_cache.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// LCD controller. The mode is advanced by one scheduled event per mode change (three per
+// visible line, one per VBlank line); LY and STAT are plain fields in between. The owner
+// renders each line in one go when it enters HBlank, into whatever frame buffer it provides.
+// Mode 3 has its minimum length: sprite and SCX penalties are not modelled.
+//
+// Colours go out as 0xAARRGGBB. bg_rgb/obj_rgb hold the final colour of every palette entry
+// and are only recomputed when a palette register or palette RAM byte is written.
+struct Ppu
+{
+    static constexpr std::uint16_t LCDC = 0xFF40;
+    static constexpr std::uint16_t STAT = 0xFF41;
+    static constexpr std::uint16_t SCY = 0xFF42;
+    static constexpr std::uint16_t SCX = 0xFF43;
+    static constexpr std::uint16_t LY = 0xFF44;
+    static constexpr std::uint16_t LYC = 0xFF45;
+    static constexpr std::uint16_t BGP = 0xFF47;
+    static constexpr std::uint16_t OBP0 = 0xFF48;
+    static constexpr std::uint16_t OBP1 = 0xFF49;
+    static constexpr std::uint16_t WY = 0xFF4A;
+    static constexpr std::uint16_t WX = 0xFF4B;
+    static constexpr std::uint16_t BCPS = 0xFF68;
+    static constexpr std::uint16_t BCPD = 0xFF69;
+    static constexpr std::uint16_t OCPS = 0xFF6A;
+    static constexpr std::uint16_t OCPD = 0xFF6B;
+
+    static constexpr std::size_t screen_width = 160;
+    static constexpr std::size_t screen_height = 144;
+
+    static constexpr std::uint64_t dots_per_line = 456;
+    static constexpr std::uint64_t oam_scan_dots = 80;
+    static constexpr std::uint64_t transfer_dots = 172;
+    static constexpr std::uint8_t visible_lines = 144;
+    static constexpr std::uint8_t line_count = 154;
+    static constexpr std::uint64_t frame_dots = dots_per_line * line_count;
+    static constexpr std::size_t max_sprites_per_line = Sprite_lists::max_per_line;
+
+    static constexpr std::array<std::uint32_t, 4> dmg_shades{ 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000 };
+    static constexpr std::uint8_t obj_index_base = 32;
+    static constexpr std::uint8_t blank_index = 4;  // DMG with the BG off: BG palette 1 stays white
+    // 5-bit CGB channel to 8 bits
+    static constexpr std::array<std::uint8_t, 32> color_levels = []
+    {
+        std::array<std::uint8_t, 32> levels{};
+        for (std::size_t i = 0; i < levels.size(); ++i)
+            levels[i] = static_cast<std::uint8_t>(i << 3 | i >> 2);
+        return levels;
+    }();
+
+    enum Mode : std::uint8_t
+    {
+        hblank = 0,
+        vblank = 1,
+        oam_scan = 2,
+        transfer = 3
+    };
+
+    std::uint8_t lcdc = 0x91;
+    std::uint8_t stat{};  // only the interrupt select bits 3-6
+    std::uint8_t scy{};
+    std::uint8_t scx{};
+    std::uint8_t ly{};
+    std::uint8_t lyc{};
+    std::uint8_t bgp = 0xFC;
+    std::uint8_t obp0 = 0xFF;
+    std::uint8_t obp1 = 0xFF;
+    std::uint8_t wy{};
+    std::uint8_t wx{};
+    Mode mode = oam_scan;
+    bool stat_line = false;
+    std::uint8_t window_line{};
+
+    bool cgb = false;
+    std::uint8_t bcps{};
+    std::uint8_t ocps{};
+    std::array<std::uint8_t, 64> bg_palette_ram{};
+    std::array<std::uint8_t, 64> obj_palette_ram{};
+    std::array<std::uint32_t, 32> bg_rgb{};   // 8 palettes of 4 colours; DMG uses palette 0
+    std::array<std::uint32_t, 32> obj_rgb{};  // DMG uses palettes 0 and 1 for OBP0/OBP1
+
+    bool enabled() const
+    {
+        return (lcdc & 0x80) != 0;
+    }
+
+    // The boot ROM leaves every CGB palette white.
+    void reset_palettes(bool cgb_)
+    {
+        cgb = cgb_;
+        bg_palette_ram.fill(0xFF);
+        obj_palette_ram.fill(0xFF);
+        bg_rgb.fill(to_rgb(0x7FFF));
+        obj_rgb.fill(to_rgb(0x7FFF));
+        if (!cgb)
+        {
+            update_dmg_palette(bg_rgb, 0, bgp);
+            update_dmg_palette(obj_rgb, 0, obp0);
+            update_dmg_palette(obj_rgb, 4, obp1);
+        }
+    }
+
+    void start(std::uint64_t now, Scheduler& scheduler)
+    {
+        ly = 0;
+        window_line = 0;
+        mode = oam_scan;
+        scheduler.schedule(Event::ppu_mode, now + oam_scan_dots);
+    }
+
+    std::uint8_t read(std::uint16_t address) const
+    {
+        switch (address)
+        {
+            case LCDC: return lcdc;
+            case STAT: return 0x80 | stat | (ly == lyc ? 0x04 : 0) | (enabled() ? mode : 0);
+            case SCY: return scy;
+            case SCX: return scx;
+            case LY: return ly;
+            case LYC: return lyc;
+            case BGP: return bgp;
+            case OBP0: return obp0;
+            case OBP1: return obp1;
+            case WY: return wy;
+            case WX: return wx;
+            case BCPS: return bcps | 0x40;
+            case BCPD: return bg_palette_ram[bcps & 0x3F];
+            case OCPS: return ocps | 0x40;
+            case OCPD: return obj_palette_ram[ocps & 0x3F];
+            default: return 0xFF;
+        }
+    }
+
+    void write(std::uint16_t address, std::uint8_t value, std::uint64_t now, Scheduler& scheduler, Interrupts& interrupts)
+    {
+        switch (address)
+        {
+            case LCDC:
+            {
+                const bool was_enabled = enabled();
+                lcdc = value;
+                if (was_enabled && !enabled())
+                {
+                    ly = 0;
+                    mode = hblank;
+                    scheduler.cancel(Event::ppu_mode);
+                }
+                else if (!was_enabled && enabled())
+                    start(now, scheduler);
+                break;
+            }
+            case STAT: stat = value & 0x78; break;
+            case SCY: scy = value; break;
+            case SCX: scx = value; break;
+            case LYC: lyc = value; break;
+            case BGP:
+                bgp = value;
+                if (!cgb)
+                    update_dmg_palette(bg_rgb, 0, bgp);
+                break;
+            case OBP0:
+                obp0 = value;
+                if (!cgb)
+                    update_dmg_palette(obj_rgb, 0, obp0);
+                break;
+            case OBP1:
+                obp1 = value;
+                if (!cgb)
+                    update_dmg_palette(obj_rgb, 4, obp1);
+                break;
+            case WY: wy = value; break;
+            case WX: wx = value; break;
+            case BCPS: bcps = value & 0xBF; break;
+            case BCPD: write_palette(bg_palette_ram, bg_rgb, bcps, value); break;
+            case OCPS: ocps = value & 0xBF; break;
+            case OCPD: write_palette(obj_palette_ram, obj_rgb, ocps, value); break;
+            default: break;
+        }
+        update_stat_line(interrupts);
+    }
+
+    // Handles Event::ppu_mode and returns the mode it is in afterwards. VBlank is entered
+    // once per frame, on line 144.
+    Mode advance(std::uint64_t at, Scheduler& scheduler, Interrupts& interrupts)
+    {
+        switch (mode)
+        {
+            case oam_scan:
+                mode = transfer;
+                scheduler.schedule(Event::ppu_mode, at + transfer_dots);
+                break;
+            case transfer:
+                mode = hblank;
+                scheduler.schedule(Event::ppu_mode, at + dots_per_line - oam_scan_dots - transfer_dots);
+                break;
+            case hblank:
+                ++ly;
+                if (ly == visible_lines)
+                {
+                    mode = vblank;
+                    interrupts.request(Interrupts::vblank);
+                    scheduler.schedule(Event::ppu_mode, at + dots_per_line);
+                }
+                else
+                {
+                    mode = oam_scan;
+                    scheduler.schedule(Event::ppu_mode, at + oam_scan_dots);
+                }
+                break;
+            case vblank:
+                if (++ly == line_count)
+                {
+                    ly = 0;
+                    window_line = 0;
+                    mode = oam_scan;
+                    scheduler.schedule(Event::ppu_mode, at + oam_scan_dots);
+                }
+                else
+                    scheduler.schedule(Event::ppu_mode, at + dots_per_line);
+                break;
+        }
+        update_stat_line(interrupts);
+        return mode;
+    }
+
+    // vram and vram_bank1 point at 0x8000 of each bank, oam at 0xFE00; out and out_index at
+    // the line's pixels and palette indices. Tile data is read through tiles and the sprites
+    // on the line through sprites, which the owner keeps in step with VRAM and OAM writes.
+    void render_line(const std::uint8_t* vram, const std::uint8_t* vram_bank1, const std::uint8_t* oam, Tile_cache& tiles, Sprite_lists& sprites, std::uint32_t* out, std::uint8_t* out_index)
+    {
+        std::array<std::uint8_t, screen_width> bg_index{};  // colour index, bit 7 = CGB BG-to-OAM priority
+
+        if (cgb || (lcdc & 0x01) != 0)
+            render_background(vram, vram_bank1, tiles, out, out_index, bg_index);
+        else
+        {
+            std::fill(out, out + screen_width, bg_rgb[blank_index]);
+            std::fill(out_index, out_index + screen_width, blank_index);
+        }
+
+        if ((lcdc & 0x02) != 0)
+            render_sprites(vram, vram_bank1, oam, tiles, sprites, out, out_index, bg_index);
+    }
+
+    // Rec. 601 luma of every palette entry, in the order of the index plane.
+    void fill_luma(std::array<std::uint8_t, 64>& luma) const
+    {
+        const auto to_luma = [](std::uint32_t rgb)
+        {
+            return static_cast<std::uint8_t>(((rgb >> 16 & 0xFF) * 77 + (rgb >> 8 & 0xFF) * 150 + (rgb & 0xFF) * 29) >> 8);
+        };
+        for (std::size_t i = 0; i < 32; ++i)
+        {
+            luma[i] = to_luma(bg_rgb[i]);
+            luma[obj_index_base + i] = to_luma(obj_rgb[i]);
+        }
+    }
+
+private:
+    static std::uint32_t to_rgb(std::uint16_t color)
+    {
+        return 0xFF000000u | color_levels[color & 0x1F] << 16 | color_levels[color >> 5 & 0x1F] << 8 | color_levels[color >> 10 & 0x1F];
+    }
+
+    static void update_dmg_palette(std::array<std::uint32_t, 32>& rgb, std::size_t first, std::uint8_t palette)
+    {
+        for (std::size_t i = 0; i < 4; ++i)
+            rgb[first + i] = dmg_shades[palette >> (i * 2) & 3];
+    }
+
+    static void write_palette(std::array<std::uint8_t, 64>& ram, std::array<std::uint32_t, 32>& rgb, std::uint8_t& specification, std::uint8_t value)
+    {
+        const std::size_t index = specification & 0x3F;
+        ram[index] = value;
+        const std::size_t color = index / 2;
+        rgb[color] = to_rgb(static_cast<std::uint16_t>(ram[color * 2] | ram[color * 2 + 1] << 8));
+        if ((specification & 0x80) != 0)
+            specification = 0x80 | ((index + 1) & 0x3F);
+    }
+
+    // Offset of a tile's data from 0x8000 under the current addressing mode.
+    std::size_t tile_address(std::uint8_t tile) const
+    {
+        if ((lcdc & 0x10) != 0)
+            return tile * 16;
+        return 0x1000 + static_cast<std::int8_t>(tile) * 16;
+    }
+
+    // One tile's worth of pixels at a time: the map entry is read once per tile and the
+    // pixels are copied from the decoded row.
+    void render_background(const std::uint8_t* vram, const std::uint8_t* vram_bank1, Tile_cache& tiles, std::uint32_t* out, std::uint8_t* out_index, std::array<std::uint8_t, screen_width>& bg_index)
+    {
+        const bool window_visible = (lcdc & 0x20) != 0 && wy <= ly && wx <= 166;
+        const int window_x = wx - 7;
+        for (int x = 0; x < static_cast<int>(screen_width);)
+        {
+            const bool in_window = window_visible && x >= window_x;
+            const std::uint8_t map_x = in_window ? x - window_x : x + scx;
+            const std::uint8_t map_y = in_window ? window_line : ly + scy;
+            const std::size_t map_base = (lcdc & (in_window ? 0x40 : 0x08)) != 0 ? 0x1C00 : 0x1800;
+            const std::size_t map_index = map_base + (map_y / 8) * 32 + map_x / 8;
+
+            const std::uint8_t attributes = cgb ? vram_bank1[map_index] : 0;
+            const std::size_t bank = (attributes & 0x08) != 0 ? 1 : 0;
+            const int row = (attributes & 0x40) != 0 ? 7 - map_y % 8 : map_y % 8;
+            const std::uint8_t* pixels = tiles.row(bank != 0 ? vram_bank1 : vram, bank, tile_address(vram[map_index]) / 16, row, (attributes & 0x20) != 0);
+            const std::uint8_t palette = (attributes & 0x07) * 4;
+            const std::uint8_t priority = attributes & 0x80;
+
+            int end = std::min(x + 8 - map_x % 8, static_cast<int>(screen_width));
+            if (window_visible && !in_window && window_x > x && window_x < end)
+                end = window_x;
+            for (int column = map_x % 8; x < end; ++x, ++column)
+            {
+                const std::uint8_t index = pixels[column];
+                bg_index[x] = index | priority;
+                out_index[x] = palette + index;
+                out[x] = bg_rgb[palette + index];
+            }
+        }
+        if (window_visible && window_x < static_cast<int>(screen_width))
+            ++window_line;
+    }
+
+    void render_sprites(const std::uint8_t* vram, const std::uint8_t* vram_bank1, const std::uint8_t* oam, Tile_cache& tiles, Sprite_lists& sprites, std::uint32_t* out, std::uint8_t* out_index, const std::array<std::uint8_t, screen_width>& bg_index)
+    {
+        const int height = (lcdc & 0x04) != 0 ? 16 : 8;
+        const Sprite_lists::Line& selected = sprites.line(oam, ly, height, cgb);
+
+        std::array<bool, screen_width> covered{};
+        for (std::size_t i = 0; i < selected.count; ++i)
+        {
+            const std::uint8_t* entry = oam + selected.sprites[i] * 4;
+            const int left = entry[1] - 8;
+            const std::uint8_t attributes = entry[3];
+            const std::uint8_t tile = height == 16 ? entry[2] & 0xFE : entry[2];
+            int row = ly - (entry[0] - 16);
+            if ((attributes & 0x40) != 0)
+                row = height - 1 - row;
+            const std::size_t bank = cgb && (attributes & 0x08) != 0 ? 1 : 0;
+            const std::uint8_t* pixels = tiles.row(bank != 0 ? vram_bank1 : vram, bank, tile + row / 8, row % 8, (attributes & 0x20) != 0);
+            const std::size_t palette = cgb ? (attributes & 0x07) : (attributes >> 4 & 1);
+
+            for (int pixel = 0; pixel < 8; ++pixel)
+            {
+                const int x = left + pixel;
+                if (x < 0 || x >= static_cast<int>(screen_width) || covered[x])
+                    continue;
+                const std::uint8_t index = pixels[pixel];
+                if (index == 0)
+                    continue;
+                covered[x] = true;
+
+                const std::uint8_t background = bg_index[x];
+                const bool behind = cgb
+                    ? (lcdc & 0x01) != 0 && (background & 0x03) != 0 && ((background & 0x80) != 0 || (attributes & 0x80) != 0)
+                    : (attributes & 0x80) != 0 && (background & 0x03) != 0;
+                if (!behind)
+                {
+                    out_index[x] = static_cast<std::uint8_t>(obj_index_base + palette * 4 + index);
+                    out[x] = obj_rgb[palette * 4 + index];
+                }
+            }
+        }
+    }
+
+    // The STAT interrupt fires on a rising edge of the OR of all selected conditions.
+    void update_stat_line(Interrupts& interrupts)
+    {
+        const bool line = enabled() && (((stat & 0x40) != 0 && ly == lyc)
+            || ((stat & 0x08) != 0 && mode == hblank)
+            || ((stat & 0x10) != 0 && mode == vblank)
+            || ((stat & 0x20) != 0 && mode == oam_scan));
+        if (line && !stat_line)
+            interrupts.request(Interrupts::stat);
+        stat_line = line;
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Per-instance execution counters, filled in by Cpu_state when a profile is attached.
+// Nothing in here is shared between threads; batch runs merge finished profiles instead.
+struct Profile
+{
+    static constexpr std::size_t region_count = 256; // PC regions and memory pages are 256 bytes
+    static constexpr std::size_t max_instruction_cycles = 32;
+
+    std::array<std::uint64_t, 256> opcode_executions{};
+    std::array<std::uint64_t, 256> opcode_cycles{};
+    std::array<std::uint64_t, 256> opcode_host_nanoseconds{};
+    std::array<std::uint64_t, max_instruction_cycles> cycle_histogram{};
+    std::array<std::uint64_t, region_count> region_executions{};
+    std::array<std::uint64_t, region_count> region_host_nanoseconds{};
+    std::array<std::uint64_t, region_count> page_reads{};
+    std::array<std::uint64_t, region_count> page_writes{};
+    // Opcodes executed back to back, by first << 8 | second: the candidates for fusing
+    std::vector<std::uint64_t> opcode_pairs = std::vector<std::uint64_t>(256 * 256);
+    int previous_instruction = -1;
+
+    void record_instruction(std::uint16_t address, std::uint8_t instruction, std::uint64_t cycles, std::uint64_t host_nanoseconds)
+    {
+        opcode_executions[instruction] += 1;
+        opcode_cycles[instruction] += cycles;
+        opcode_host_nanoseconds[instruction] += host_nanoseconds;
+        cycle_histogram[cycles < max_instruction_cycles ? cycles : max_instruction_cycles - 1] += 1;
+        region_executions[address >> 8] += 1;
+        region_host_nanoseconds[address >> 8] += host_nanoseconds;
+        if (previous_instruction >= 0)
+            opcode_pairs[previous_instruction << 8 | instruction] += 1;
+        previous_instruction = instruction;
+    }
+
+    void merge(const Profile& other)
+    {
+        add(opcode_executions, other.opcode_executions);
+        add(opcode_cycles, other.opcode_cycles);
+        add(opcode_host_nanoseconds, other.opcode_host_nanoseconds);
+        add(cycle_histogram, other.cycle_histogram);
+        add(region_executions, other.region_executions);
+        add(region_host_nanoseconds, other.region_host_nanoseconds);
+        add(page_reads, other.page_reads);
+        add(page_writes, other.page_writes);
+        for (std::size_t i = 0; i < opcode_pairs.size(); ++i)
+            opcode_pairs[i] += other.opcode_pairs[i];
+    }
+
+    // One row per table entry: table,index,count,cycles,host_ns
+    void write_csv(std::ostream& out) const
+    {
+        out << "table,index,count,cycles,host_ns\n";
+        for (std::size_t i = 0; i < 256; ++i)
+            if (opcode_executions[i] != 0)
+                out << "opcode," << i << ',' << opcode_executions[i] << ',' << opcode_cycles[i] << ',' << opcode_host_nanoseconds[i] << '\n';
+        for (std::size_t i = 0; i < max_instruction_cycles; ++i)
+            if (cycle_histogram[i] != 0)
+                out << "cycle_histogram," << i << ',' << cycle_histogram[i] << ",,\n";
+        for (std::size_t i = 0; i < region_count; ++i)
+            if (region_executions[i] != 0)
+                out << "pc_region," << (i << 8) << ',' << region_executions[i] << ",," << region_host_nanoseconds[i] << '\n';
+        for (std::size_t i = 0; i < region_count; ++i)
+            if (page_reads[i] != 0)
+                out << "page_reads," << (i << 8) << ',' << page_reads[i] << ",,\n";
+        for (std::size_t i = 0; i < region_count; ++i)
+            if (page_writes[i] != 0)
+                out << "page_writes," << (i << 8) << ',' << page_writes[i] << ",,\n";
+        for (std::size_t i = 0; i < opcode_pairs.size(); ++i)
+            if (opcode_pairs[i] != 0)
+                out << "opcode_pair," << i << ',' << opcode_pairs[i] << ",,\n";
+    }
+
+    void write_json(std::ostream& out) const
+    {
+        out << "{\n";
+        write_json_array(out, "opcode_executions", opcode_executions);
+        out << ",\n";
+        write_json_array(out, "opcode_cycles", opcode_cycles);
+        out << ",\n";
+        write_json_array(out, "opcode_host_ns", opcode_host_nanoseconds);
+        out << ",\n";
+        write_json_array(out, "cycle_histogram", cycle_histogram);
+        out << ",\n";
+        write_json_array(out, "pc_region_executions", region_executions);
+        out << ",\n";
+        write_json_array(out, "pc_region_host_ns", region_host_nanoseconds);
+        out << ",\n";
+        write_json_array(out, "page_reads", page_reads);
+        out << ",\n";
+        write_json_array(out, "page_writes", page_writes);
+        out << ",\n  \"opcode_pairs\": {";
+        const char* separator = "";
+        for (std::size_t i = 0; i < opcode_pairs.size(); ++i)
+        {
+            if (opcode_pairs[i] != 0)
+            {
+                out << separator << '"' << i << "\":" << opcode_pairs[i];
+                separator = ",";
+            }
+        }
+        out << "}\n}\n";
+    }
+
+private:
+
+    template <std::size_t size>
+    static void add(std::array<std::uint64_t, size>& to, const std::array<std::uint64_t, size>& from)
+    {
+        for (std::size_t i = 0; i < size; ++i)
+            to[i] += from[i];
+    }
+
+    template <std::size_t size>
+    static void write_json_array(std::ostream& out, const char* name, const std::array<std::uint64_t, size>& values)
+    {
+        out << "  \"" << name << "\": [";
+        for (std::size_t i = 0; i < size; ++i)
+            out << (i == 0 ? "" : ",") << values[i];
+        out << ']';
+    }
+};
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "Frame_pipeline.h"
+#include "Interrupts.h"
+#include "Ppu.h"
+#include "Scheduler.h"
+#include "Spsc_queue.h"
+#include "Sprite_lists.h"
+#include "Tile_cache.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <thread>
+
+// One entry of the log the CPU keeps for the render thread, in the order things happened.
+struct Video_write
+{
+    enum Kind : std::uint8_t
+    {
+        vram,          // address in 0x8000-0x9FFF of bank
+        oam,           // address in 0xFE00-0xFE9F
+        ppu_register,  // LCD and CGB palette registers
+        line,          // draw line value
+        frame,         // publish the frame; at is its sequence number
+        fence,
+        stop
+    };
+
+    Kind kind{};
+    std::uint8_t bank{};
+    std::uint8_t value{};
+    std::uint16_t address{};
+    std::uint64_t at{};  // cycle of the write
+};
+
+// Pixel generation on a thread of its own. The CPU keeps running the PPU's timing (modes, LY,
+// STAT and interrupts) and logs every write to VRAM, OAM and the LCD registers together with
+// the points where it would have drawn a line. This thread keeps its own copy of the video
+// state, replays the log into it and draws each line when it reaches the marker, so the
+// pixels come out exactly as if they had been drawn inline. It publishes to the instance's
+// frame pipeline, which it then owns as the producer.
+struct Render_thread
+{
+    static constexpr std::size_t log_capacity = 1 << 16;
+    static constexpr std::chrono::microseconds spin_time{ 200 };
+
+    explicit Render_thread(Frame_pipeline& frames_)
+        : frames{ frames_ }, thread{ [this] { work(); } }
+    {
+    }
+
+    Render_thread(const Render_thread&) = delete;
+    Render_thread& operator=(const Render_thread&) = delete;
+
+    ~Render_thread()
+    {
+        push({ Video_write::stop });
+        wake();
+        thread.join();
+    }
+
+    // Producer side. Only when the log is empty: at creation or after finish().
+    void reset(const Ppu& ppu_, std::span<const std::uint8_t, 0x2000> vram0, std::span<const std::uint8_t, 0x2000> vram1, const std::uint8_t* oam_)
+    {
+        ppu = ppu_;
+        std::copy(vram0.begin(), vram0.end(), vram[0].begin());
+        std::copy(vram1.begin(), vram1.end(), vram[1].begin());
+        std::copy_n(oam_, oam.size(), oam.begin());
+        tiles.invalidate_all();
+        sprites.dirty = true;
+    }
+
+    void write(Video_write::Kind kind, std::uint16_t address, std::uint8_t value, std::uint64_t at, std::uint8_t bank = 0)
+    {
+        push({ kind, bank, value, address, at });
+    }
+
+    void render_line(std::uint8_t ly, std::uint64_t at)
+    {
+        push({ Video_write::line, 0, ly, 0, at });
+        wake();
+    }
+
+    void end_frame(std::uint64_t sequence)
+    {
+        push({ Video_write::frame, 0, 0, 0, sequence });
+        wake();
+    }
+
+    // Returns once everything logged so far has been replayed and published.
+    void finish()
+    {
+        push({ Video_write::fence });
+        wake();
+        ++fences_sent;
+        for (auto done = fences_done.load(std::memory_order_acquire); done != fences_sent; done = fences_done.load(std::memory_order_acquire))
+            fences_done.wait(done, std::memory_order_acquire);
+    }
+
+    // Only after finish().
+    std::uint8_t window_line() const
+    {
+        return ppu.window_line;
+    }
+
+private:
+    void push(const Video_write& write)
+    {
+        while (!log.push(write))
+        {
+            wake();
+            std::this_thread::yield();
+        }
+    }
+
+    void wake()
+    {
+        // Pairs with the fence in work(): either this sees sleeping or the renderer sees the entries.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed))
+        {
+            sleeping.store(false, std::memory_order_relaxed);
+            sleeping.notify_one();
+        }
+    }
+
+    void work()
+    {
+        Video_write write;
+        while (true)
+        {
+            while (log.pop(write))
+            {
+                if (write.kind == Video_write::stop)
+                    return;
+                replay(write);
+            }
+
+            // Lines arrive a few microseconds apart while the CPU runs, so spin briefly
+            // before going to sleep.
+            const auto deadline = std::chrono::steady_clock::now() + spin_time;
+            while (log.empty() && std::chrono::steady_clock::now() < deadline)
+                std::this_thread::yield();
+            if (!log.empty())
+                continue;
+
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (log.empty())
+                sleeping.wait(true, std::memory_order_relaxed);
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void replay(const Video_write& write)
+    {
+        switch (write.kind)
+        {
+            case Video_write::vram:
+                vram[write.bank][write.address - 0x8000] = write.value;
+                tiles.invalidate(write.bank, write.address - 0x8000);
+                break;
+            case Video_write::oam:
+                oam[write.address - 0xFE00] = write.value;
+                sprites.dirty = true;
+                break;
+            case Video_write::ppu_register:
+                ppu.write(write.address, write.value, write.at, scheduler, interrupts);
+                break;
+            case Video_write::line:
+            {
+                Frame& frame = frames.back_buffer();
+                const auto line = write.value * Frame::width;
+                ppu.ly = write.value;
+                // Ppu::advance restarts the window at line 0, which this copy never runs
+                if (ppu.ly == 0)
+                    ppu.window_line = 0;
+                ppu.render_line(vram[0].data(), vram[1].data(), oam.data(), tiles, sprites, &frame.pixels[line], &frame.indices[line]);
+                break;
+            }
+            case Video_write::frame:
+                ppu.fill_luma(frames.back_buffer().luma);
+                frames.publish(write.at);
+                break;
+            case Video_write::fence:
+                fences_done.fetch_add(1, std::memory_order_release);
+                fences_done.notify_one();
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Render side. The scheduler and interrupts only absorb what Ppu::write does to them.
+    Ppu ppu;
+    std::array<std::array<std::uint8_t, 0x2000>, 2> vram{};
+    std::array<std::uint8_t, 0xA0> oam{};
+    Tile_cache tiles;
+    Sprite_lists sprites;
+    Scheduler scheduler;
+    Interrupts interrupts;
+    Frame_pipeline& frames;
+
+    Spsc_queue<Video_write, log_capacity> log;
+    std::atomic<bool> sleeping{ false };
+    std::atomic<std::uint64_t> fences_done{};
+    std::uint64_t fences_sent{};  // producer only
+    std::thread thread;
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "Cpu_state.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// The last max_states savestates in a fixed byte budget. Only the newest state is kept whole;
+// every older one is stored as the XOR of itself and its successor, run-length encoded, so
+// popping walks backwards by XORing deltas into the newest. Consecutive frames differ in a
+// few hundred bytes, which makes each delta tiny. When the budget or max_states is exceeded
+// the oldest deltas are dropped. All memory is allocated up front.
+struct Rewind_buffer
+{
+    static constexpr std::size_t state_size = sizeof(Savestate);
+
+    Rewind_buffer(std::size_t max_states_, std::size_t byte_budget = 32 << 20)
+        : data(byte_budget), records(std::max<std::size_t>(max_states_, 2) - 1), latest(state_size),
+          scratch(max_encoded_size), state{ std::make_unique<Savestate>() }
+    {
+    }
+
+    // Number of states that pop can still return.
+    std::size_t size() const
+    {
+        return has_latest ? count + 1 : 0;
+    }
+
+    void clear()
+    {
+        has_latest = false;
+        count = 0;
+        head = 0;
+    }
+
+    void push(const Savestate& next)
+    {
+        const auto* bytes = reinterpret_cast<const std::uint8_t*>(&next);
+        if (has_latest)
+        {
+            const std::size_t size = encode(latest.data(), bytes, scratch.data());
+            if (std::uint8_t* destination = allocate(size))
+                std::memcpy(destination, scratch.data(), size);
+            else
+                clear();
+        }
+        std::memcpy(latest.data(), bytes, state_size);
+        has_latest = true;
+    }
+
+    // Writes the newest state to out and forgets it. Returns false once the history is empty.
+    bool pop(Savestate& out)
+    {
+        if (!has_latest)
+            return false;
+        std::memcpy(&out, latest.data(), state_size);
+        if (count == 0)
+        {
+            has_latest = false;
+            return true;
+        }
+        const Record& newest = records[(first + count - 1) % records.size()];
+        decode(&data[newest.offset], latest.data());
+        // With the last delta gone allocate starts over at the front, as after drop_oldest
+        head = --count == 0 ? 0 : newest.offset;
+        return true;
+    }
+
+    void record(const Cpu_state& cpu)
+    {
+        cpu.save_state(*state);
+        push(*state);
+    }
+
+    // Steps cpu back to the newest recorded state. Call record once per frame and rewind once
+    // per frame while rewinding; the first rewind returns to the frame recorded last.
+    bool rewind(Cpu_state& cpu)
+    {
+        if (!pop(*state))
+            return false;
+        cpu.load_state(*state);
+        return true;
+    }
+
+    // Bytes in use by deltas, for sizing the budget.
+    std::size_t used() const
+    {
+        if (count == 0)
+            return 0;
+        const std::size_t tail = records[first].offset;
+        return tail < head ? head - tail : data.size() - tail + head;
+    }
+
+private:
+    struct Record
+    {
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    // A delta is a list of (equal bytes to skip, changed bytes, XORed changed bytes). A change
+    // run only ends at min_equal_run matching bytes, which bounds the number of tokens.
+    static constexpr std::size_t min_equal_run = 4;
+    static constexpr std::size_t max_varint = 3;  // enough for any offset within a Savestate
+    static constexpr std::size_t max_encoded_size = state_size + 2 * max_varint * (state_size / min_equal_run + 2);
+
+    static_assert(state_size < (1 << 21));
+
+    static std::uint64_t load(const std::uint8_t* bytes)
+    {
+        std::uint64_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+
+    static std::uint8_t* write_varint(std::uint8_t* out, std::size_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = static_cast<std::uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = static_cast<std::uint8_t>(value);
+        return out;
+    }
+
+    static const std::uint8_t* read_varint(const std::uint8_t* in, std::size_t& value)
+    {
+        value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            value |= static_cast<std::size_t>(*in & 0x7F) << shift;
+            if ((*in++ & 0x80) == 0)
+                return in;
+        }
+    }
+
+    static std::size_t encode(const std::uint8_t* from, const std::uint8_t* to, std::uint8_t* out)
+    {
+        std::uint8_t* const start = out;
+        std::size_t i = 0;
+        while (i < state_size)
+        {
+            const std::size_t equal_start = i;
+            while (i + 8 <= state_size && load(from + i) == load(to + i))
+                i += 8;
+            while (i < state_size && from[i] == to[i])
+                ++i;
+            const std::size_t changed_start = i;
+            std::size_t equal = 0;
+            while (i < state_size && equal < min_equal_run)
+            {
+                equal = from[i] == to[i] ? equal + 1 : 0;
+                ++i;
+            }
+            i -= equal;
+            out = write_varint(out, changed_start - equal_start);
+            out = write_varint(out, i - changed_start);
+            for (std::size_t j = changed_start; j < i; ++j)
+                *out++ = from[j] ^ to[j];
+        }
+        return out - start;
+    }
+
+    static void decode(const std::uint8_t* in, std::uint8_t* state)
+    {
+        std::size_t i = 0;
+        while (i < state_size)
+        {
+            std::size_t equal;
+            std::size_t changed;
+            in = read_varint(in, equal);
+            in = read_varint(in, changed);
+            i += equal;
+            for (const std::size_t end = i + changed; i < end; ++i)
+                state[i] ^= *in++;
+        }
+    }
+
+    void drop_oldest()
+    {
+        first = (first + 1) % records.size();
+        if (--count == 0)
+            head = 0;
+    }
+
+    // Finds size contiguous bytes after the newest delta, dropping the oldest ones to make
+    // room. Returns null if the delta is larger than the whole budget.
+    std::uint8_t* allocate(std::size_t size)
+    {
+        if (size > data.size())
+            return nullptr;
+        if (count == records.size())
+            drop_oldest();
+        while (count != 0)
+        {
+            const std::size_t tail = records[first].offset;
+            if (tail < head)
+            {
+                if (data.size() - head >= size)
+                    break;
+                if (tail >= size)
+                {
+                    head = 0;
+                    break;
+                }
+            }
+            else if (tail - head >= size)
+                break;
+            drop_oldest();
+        }
+        records[(first + count) % records.size()] = { head, size };
+        ++count;
+        std::uint8_t* destination = &data[head];
+        head += size;
+        return destination;
+    }
+
+    std::vector<std::uint8_t> data;
+    std::vector<Record> records;  // circular, oldest at first
+    std::size_t first = 0;
+    std::size_t count = 0;
+    std::size_t head = 0;  // end of the newest delta
+    std::vector<std::uint8_t> latest;
+    bool has_latest = false;
+    std::vector<std::uint8_t> scratch;
+    std::unique_ptr<Savestate> state;
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "Rom_map.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <span>
+#include <string>
+#include <vector>
+
+// Where an instruction sends control, as far as static analysis is concerned.
+enum class Flow : std::uint8_t
+{
+    next,
+    jump,              // JP a16, JR r8
+    conditional_jump,
+    call,              // CALL a16, RST
+    conditional_call,
+    ret,               // RET, RETI
+    conditional_ret,
+    indirect_jump,     // JP (HL)
+    illegal            // not an opcode: the CPU locks up
+};
+
+struct Opcode_info
+{
+    std::string mnemonic;
+    std::string operands;  // as written, e.g. "A,(HL+)"
+    std::string group;  // e.g. "x8/alu", which picks the Cpu_state handler that runs it
+    std::uint8_t length{};  // including the CB prefix
+    Flow flow = Flow::illegal;
+    bool relative = false;  // the target is a signed offset from the next instruction
+    std::uint16_t vector{};  // RST target
+};
+
+// Lengths and control flow of every opcode, read from opcodes.json.
+struct Opcode_table
+{
+    std::array<Opcode_info, 256> unprefixed{};
+    std::array<Opcode_info, 256> cb_prefixed{};
+
+    // Opcodes the file does not list stay illegal. Returns false if in is not opcodes.json.
+    bool load(std::istream& in)
+    {
+        const auto json = nlohmann::json::parse(in, nullptr, false);
+        if (json.is_discarded() || !json.contains("unprefixed") || !json.contains("cbprefixed"))
+            return false;
+        for (const auto& [key, entry] : json["unprefixed"].items())
+            unprefixed[std::stoul(key, nullptr, 16) & 0xFF] = describe(entry);
+        for (const auto& [key, entry] : json["cbprefixed"].items())
+            cb_prefixed[std::stoul(key, nullptr, 16) & 0xFF] = describe(entry);
+        // opcodes.json lists STOP as one byte; the CPU skips the byte after it
+        unprefixed[0x10].length = 2;
+        return true;
+    }
+
+    const Opcode_info& at(std::span<const std::uint8_t> rom, std::size_t address) const
+    {
+        const Opcode_info& info = unprefixed[rom[address]];
+        if (info.mnemonic == "PREFIX" && address + 1 < rom.size())
+            return cb_prefixed[rom[address + 1]];
+        return info;
+    }
+
+private:
+    static Opcode_info describe(const nlohmann::json& entry)
+    {
+        Opcode_info info;
+        info.mnemonic = entry.value("mnemonic", "");
+        info.length = entry.value("length", 0);
+        info.group = entry.value("group", "");
+        const std::string operand1 = entry.value("operand1", "");
+        const bool conditional = entry.contains("operand2");
+        info.operands = conditional ? operand1 + "," + entry.value("operand2", "") : operand1;
+        if (info.mnemonic == "JP")
+            info.flow = operand1 == "(HL)" || operand1 == "HL" ? Flow::indirect_jump : conditional ? Flow::conditional_jump : Flow::jump;
+        else if (info.mnemonic == "JR")
+        {
+            info.flow = conditional ? Flow::conditional_jump : Flow::jump;
+            info.relative = true;
+        }
+        else if (info.mnemonic == "CALL")
+            info.flow = conditional ? Flow::conditional_call : Flow::call;
+        else if (info.mnemonic == "RST")
+        {
+            info.flow = Flow::call;
+            info.vector = static_cast<std::uint16_t>(std::stoul(operand1, nullptr, 16));
+        }
+        else if (info.mnemonic == "RET")
+            info.flow = operand1.empty() ? Flow::ret : Flow::conditional_ret;
+        else if (info.mnemonic == "RETI")
+            info.flow = Flow::ret;
+        else
+            info.flow = Flow::next;
+        return info;
+    }
+};
+
+// Recursive-descent disassembly: decodes from each entry point along every path control can
+// take, so data between routines is never mistaken for code. Each CALL and RST target starts
+// a function, and calls are assumed to return. A JP (HL) ends its path and is listed in the
+// map, since where it goes depends on the program's state.
+struct Rom_analyzer
+{
+    // The cartridge entry point and the interrupt vectors. A ROM that leaves an interrupt
+    // disabled may keep anything at its vector; decoding it is harmless.
+    static constexpr std::array<std::uint16_t, 6> default_entries{ 0x0100, 0x0040, 0x0048, 0x0050, 0x0058, 0x0060 };
+
+    const Opcode_table& opcodes;
+
+    Rom_map analyze(std::span<const std::uint8_t> rom, std::span<const std::uint16_t> entries = default_entries) const
+    {
+        rom = rom.first(std::min(rom.size(), Rom_map::size));
+        Rom_map map;
+        std::vector<const Opcode_info*> decoded(Rom_map::size);
+        std::vector<bool> leader(Rom_map::size);
+        std::vector<std::uint16_t> pending;
+
+        const auto reach = [&](std::uint32_t address, bool function)
+        {
+            if (address >= rom.size())
+                return;
+            leader[address] = true;
+            if (function)
+                map.flags[address] |= Rom_map::function;
+            pending.push_back(static_cast<std::uint16_t>(address));
+        };
+        for (const auto entry : entries)
+            reach(entry, true);
+
+        while (!pending.empty())
+        {
+            std::uint32_t address = pending.back();
+            pending.pop_back();
+            while (address < rom.size() && !decoded[address])
+            {
+                const Opcode_info& info = opcodes.at(rom, address);
+                if (info.flow == Flow::illegal || address + info.length > rom.size())
+                    break;
+                decoded[address] = &info;
+                for (std::uint32_t i = address; i < address + info.length; ++i)
+                    map.flags[i] |= Rom_map::code;
+                const std::uint32_t next = address + info.length;
+
+                if (info.flow == Flow::indirect_jump)
+                    map.indirect_jumps.push_back(static_cast<std::uint16_t>(address));
+                else if (info.flow != Flow::next && info.flow != Flow::ret && info.flow != Flow::conditional_ret)
+                    reach(target(rom, address, info), info.flow == Flow::call || info.flow == Flow::conditional_call);
+                if (info.flow == Flow::jump || info.flow == Flow::ret || info.flow == Flow::indirect_jump)
+                    break;
+                // What follows a branch or call starts a block of its own
+                if (info.flow != Flow::next && next < rom.size())
+                    leader[next] = true;
+                address = next;
+            }
+        }
+
+        build_blocks(rom, decoded, leader, map);
+        build_call_graph(rom, decoded, map);
+        std::sort(map.indirect_jumps.begin(), map.indirect_jumps.end());
+        return map;
+    }
+
+    // Where a jump or call at address goes.
+    static std::uint16_t target(std::span<const std::uint8_t> rom, std::size_t address, const Opcode_info& info)
+    {
+        if (info.mnemonic == "RST")
+            return info.vector;
+        if (info.relative)
+            return static_cast<std::uint16_t>(address + 2 + static_cast<std::int8_t>(rom[address + 1]));
+        return static_cast<std::uint16_t>(rom[address + 1] | rom[address + 2] << 8);
+    }
+
+private:
+    // A block runs from a leader up to and including the first instruction that can send
+    // control elsewhere, or up to the next leader.
+    void build_blocks(std::span<const std::uint8_t> rom, const std::vector<const Opcode_info*>& decoded, const std::vector<bool>& leader, Rom_map& map) const
+    {
+        for (std::size_t start = 0; start < rom.size(); ++start)
+        {
+            if (!decoded[start] || !leader[start])
+                continue;
+            std::size_t address = start;
+            std::size_t end = address + decoded[address]->length;
+            while (decoded[address]->flow == Flow::next && end < rom.size() && decoded[end] && !leader[end])
+            {
+                address = end;
+                end = address + decoded[address]->length;
+            }
+
+            Rom_map::Block block{ static_cast<std::uint16_t>(start), static_cast<std::uint16_t>(end), {} };
+            const Opcode_info& last = *decoded[address];
+            if (last.flow == Flow::jump || last.flow == Flow::conditional_jump)
+                block.successors.push_back(target(rom, address, last));
+            const bool falls_through = last.flow != Flow::jump && last.flow != Flow::ret && last.flow != Flow::indirect_jump;
+            if (falls_through && end < rom.size() && decoded[end])
+                block.successors.push_back(static_cast<std::uint16_t>(end));
+            map.flags[start] |= Rom_map::block_start;
+            map.blocks.push_back(std::move(block));
+        }
+    }
+
+    // Each function owns the blocks it reaches without following calls; their calls are its
+    // edges.
+    void build_call_graph(std::span<const std::uint8_t> rom, const std::vector<const Opcode_info*>& decoded, Rom_map& map) const
+    {
+        std::vector<bool> visited(Rom_map::size);
+        std::vector<std::uint16_t> stack;
+        for (std::size_t function = 0; function < rom.size(); ++function)
+        {
+            if (!map.has(static_cast<std::uint16_t>(function), Rom_map::function))
+                continue;
+            std::fill(visited.begin(), visited.end(), false);
+            stack.assign(1, static_cast<std::uint16_t>(function));
+            while (!stack.empty())
+            {
+                const Rom_map::Block* block = map.block_at(stack.back());
+                stack.pop_back();
+                if (!block || visited[block->start])
+                    continue;
+                visited[block->start] = true;
+
+                std::size_t last = block->start;
+                while (last + decoded[last]->length < block->end)
+                    last += decoded[last]->length;
+                const Opcode_info& info = *decoded[last];
+                if (info.flow == Flow::call || info.flow == Flow::conditional_call)
+                    map.calls.push_back({ static_cast<std::uint16_t>(function), target(rom, last, info) });
+                for (const auto successor : block->successors)
+                    stack.push_back(successor);
+            }
+        }
+        std::sort(map.calls.begin(), map.calls.end());
+        map.calls.erase(std::unique(map.calls.begin(), map.calls.end()), map.calls.end());
+    }
+};
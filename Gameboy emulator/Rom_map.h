@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// What static analysis found in a ROM: which bytes are code, where basic blocks start and end
+// and which functions call which. Addresses are CPU addresses in the fixed 32 KiB the
+// cartridge maps at 0x0000-0x7FFF; targets outside it (code copied to RAM) appear as
+// successors and callees but are not analysed. Saved as text, one record per line and every
+// number in hex, so that tools outside the emulator can read it too:
+//   gb-rom-map 1
+//   function <address>                    an entry point or the target of a CALL or RST
+//   code <first> <end>                    the bytes in [first, end) are code
+//   block <start> <end> [<successor>...]  a basic block and where control can go next
+//   call <function> <callee>              an edge of the call graph
+//   indirect <address>                    a JP (HL), whose targets are unknown
+struct Rom_map
+{
+    static constexpr std::size_t size = 0x8000;
+
+    enum Flag : std::uint8_t
+    {
+        code = 1 << 0,
+        block_start = 1 << 1,
+        function = 1 << 2
+    };
+
+    struct Block
+    {
+        std::uint16_t start{};
+        std::uint16_t end{};  // one past the last byte
+        std::vector<std::uint16_t> successors;  // not counting callees, which calls lists
+    };
+
+    struct Call
+    {
+        std::uint16_t function{};
+        std::uint16_t callee{};
+
+        auto operator<=>(const Call&) const = default;
+    };
+
+    std::vector<std::uint8_t> flags = std::vector<std::uint8_t>(size);
+    std::vector<Block> blocks;  // by start address
+    std::vector<Call> calls;  // sorted, without duplicates
+    std::vector<std::uint16_t> indirect_jumps;
+
+    bool has(std::uint16_t address, Flag flag) const
+    {
+        return address < size && (flags[address] & flag) != 0;
+    }
+
+    const Block* block_at(std::uint16_t start) const
+    {
+        const auto block = std::lower_bound(blocks.begin(), blocks.end(), start, [](const Block& block, std::uint16_t address) { return block.start < address; });
+        return block != blocks.end() && block->start == start ? &*block : nullptr;
+    }
+
+    void write(std::ostream& out) const
+    {
+        out << std::hex << "gb-rom-map 1\n";
+        for (std::size_t address = 0; address < size; ++address)
+            if (flags[address] & function)
+                out << "function " << address << '\n';
+        for (std::size_t first = 0; first < size;)
+        {
+            if (!(flags[first] & code))
+            {
+                ++first;
+                continue;
+            }
+            std::size_t end = first;
+            while (end < size && (flags[end] & code))
+                ++end;
+            out << "code " << first << ' ' << end << '\n';
+            first = end;
+        }
+        for (const Block& block : blocks)
+        {
+            out << "block " << block.start << ' ' << block.end;
+            for (const auto successor : block.successors)
+                out << ' ' << successor;
+            out << '\n';
+        }
+        for (const Call& call : calls)
+            out << "call " << call.function << ' ' << call.callee << '\n';
+        for (const auto address : indirect_jumps)
+            out << "indirect " << address << '\n';
+        out << std::dec;
+    }
+
+    // Replaces the map with what in holds. Returns false, leaving the map empty, if in is
+    // not a map.
+    bool read(std::istream& in)
+    {
+        *this = {};
+        std::string line;
+        if (!std::getline(in, line) || line != "gb-rom-map 1")
+            return false;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields{ line };
+            fields >> std::hex;
+            std::string kind;
+            fields >> kind;
+            unsigned first = 0;
+            unsigned second = 0;
+            if (kind.empty())
+                continue;
+            if (kind == "function" && fields >> first && first < size)
+                flags[first] |= function;
+            else if (kind == "code" && fields >> first >> second && first <= second && second <= size)
+                std::for_each(flags.begin() + first, flags.begin() + second, [](std::uint8_t& flag) { flag |= code; });
+            else if (kind == "block" && fields >> first >> second && first < size && second <= size)
+            {
+                Block block{ static_cast<std::uint16_t>(first), static_cast<std::uint16_t>(second), {} };
+                for (unsigned successor; fields >> successor;)
+                    block.successors.push_back(static_cast<std::uint16_t>(successor));
+                flags[first] |= block_start;
+                blocks.push_back(std::move(block));
+            }
+            else if (kind == "call" && fields >> first >> second)
+                calls.push_back({ static_cast<std::uint16_t>(first), static_cast<std::uint16_t>(second) });
+            else if (kind == "indirect" && fields >> first)
+                indirect_jumps.push_back(static_cast<std::uint16_t>(first));
+            else
+            {
+                *this = {};
+                return false;
+            }
+        }
+        std::sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) { return a.start < b.start; });
+        std::sort(calls.begin(), calls.end());
+        return true;
+    }
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+enum class Event
+{
+    apu_frame_sequencer,
+    apu_end_batch,
+    timer_reload,
+    ppu_mode,
+    oam_dma_end,
+    serial,
+    link_sync,
+    count
+};
+
+// One pending deadline per event kind. The run loop only compares the cycle counter
+// against next_deadline, so an idle subsystem costs nothing between its events.
+struct Scheduler
+{
+    static constexpr std::uint64_t never = std::numeric_limits<std::uint64_t>::max();
+    static constexpr std::size_t event_count = static_cast<std::size_t>(Event::count);
+
+    std::array<std::uint64_t, event_count> deadlines{};
+    std::uint64_t next_deadline = never;
+
+    Scheduler()
+    {
+        deadlines.fill(never);
+    }
+
+    void schedule(Event event, std::uint64_t at)
+    {
+        deadlines[static_cast<std::size_t>(event)] = at;
+        update_next_deadline();
+    }
+
+    void cancel(Event event)
+    {
+        schedule(event, never);
+    }
+
+    std::uint64_t deadline(Event event) const
+    {
+        return deadlines[static_cast<std::size_t>(event)];
+    }
+
+    // Takes the earliest event that is due by now, if any, and clears it.
+    bool pop_due(std::uint64_t now, Event& event, std::uint64_t& at)
+    {
+        if (next_deadline > now)
+            return false;
+        std::size_t earliest = 0;
+        for (std::size_t i = 1; i < event_count; ++i)
+            if (deadlines[i] < deadlines[earliest])
+                earliest = i;
+        event = static_cast<Event>(earliest);
+        at = deadlines[earliest];
+        deadlines[earliest] = never;
+        update_next_deadline();
+        return true;
+    }
+
+private:
+    void update_next_deadline()
+    {
+        next_deadline = never;
+        for (const auto deadline : deadlines)
+            if (deadline < next_deadline)
+                next_deadline = deadline;
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Scheduler.h"
+
+#include <cstdint>
+
+// SB (0xFF01) and SC (0xFF02). A transfer on the internal clock ends after eight bits with
+// Event::serial, when the byte from the other side (0xFF with nothing connected) replaces
+// SB. On the external clock the other side drives the transfer, so all this side does is
+// wait for an exchange, which the owner schedules as Event::serial as well.
+struct Serial
+{
+    static constexpr std::uint16_t SB = 0xFF01;
+    static constexpr std::uint16_t SC = 0xFF02;
+    static constexpr std::uint64_t transfer_dots = 8 * 512;  // 8192 Hz
+    static constexpr std::uint64_t fast_transfer_dots = 8 * 16;  // CGB, 262144 Hz
+
+    std::uint8_t data{};
+    std::uint8_t control{};
+    bool exchange_pending = false;  // external clock: the other side's byte is on its way
+    std::uint8_t incoming{};
+
+    bool active() const
+    {
+        return (control & 0x80) != 0;
+    }
+
+    bool internal_clock() const
+    {
+        return (control & 0x01) != 0;
+    }
+
+    std::uint8_t read(std::uint16_t address, bool cgb) const
+    {
+        if (address == SB)
+            return data;
+        return control | (cgb ? 0x7C : 0x7E);
+    }
+
+    // Returns true if the write starts a transfer on the internal clock, whose end is then
+    // scheduled.
+    bool write(std::uint16_t address, std::uint8_t value, bool cgb, std::uint64_t now, std::uint8_t speed_shift, Scheduler& scheduler)
+    {
+        if (address == SB)
+        {
+            data = value;
+            return false;
+        }
+        control = value & (cgb ? 0x83 : 0x81);
+        if (!active() || !internal_clock())
+            return false;
+        const std::uint64_t duration = cgb && (control & 0x02) != 0 ? fast_transfer_dots : transfer_dots;
+        scheduler.schedule(Event::serial, now + (duration >> speed_shift));
+        return true;
+    }
+
+    // Ends a transfer: received is what was shifted in.
+    void complete(std::uint8_t received)
+    {
+        data = received;
+        control &= 0x7F;
+    }
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// The sprites on each visible line, at most 10, already in drawing priority order. The lists
+// are rebuilt from OAM only after OAM has been written (by the CPU or by DMA) or the sprite
+// height or priority mode changed, instead of the renderer scanning all 40 entries per line.
+struct Sprite_lists
+{
+    static constexpr std::size_t max_per_line = 10;
+    static constexpr std::size_t line_count = 144;
+    static constexpr std::size_t sprite_count = 40;
+
+    struct Line
+    {
+        std::uint8_t count{};
+        std::array<std::uint8_t, max_per_line> sprites{};  // OAM indices, highest priority first
+    };
+
+    std::array<Line, line_count> lines{};
+    bool dirty = true;
+    int height{};
+    bool cgb = false;
+
+    // oam points at 0xFE00. DMG gives the lower X priority, then the lower OAM index; CGB
+    // goes by OAM index only.
+    const Line& line(const std::uint8_t* oam, std::size_t ly, int height_, bool cgb_)
+    {
+        if (dirty || height != height_ || cgb != cgb_)
+            rebuild(oam, height_, cgb_);
+        return lines[ly];
+    }
+
+private:
+    void rebuild(const std::uint8_t* oam, int height_, bool cgb_)
+    {
+        height = height_;
+        cgb = cgb_;
+        dirty = false;
+        for (auto& line : lines)
+            line.count = 0;
+        for (std::uint8_t sprite = 0; sprite < sprite_count; ++sprite)
+        {
+            const int top = oam[sprite * 4] - 16;
+            const int first = std::max(top, 0);
+            const int last = std::min(top + height, static_cast<int>(line_count));
+            for (int y = first; y < last; ++y)
+            {
+                Line& line = lines[y];
+                if (line.count < max_per_line)
+                    line.sprites[line.count++] = sprite;
+            }
+        }
+        if (!cgb)
+        {
+            for (auto& line : lines)
+                std::stable_sort(line.sprites.begin(), line.sprites.begin() + line.count,
+                    [oam](std::uint8_t a, std::uint8_t b) { return oam[a * 4 + 1] < oam[b * 4 + 1]; });
+        }
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Single-producer/single-consumer ring. push and pop never block and never take a lock;
+// a full queue rejects the push and an empty one rejects the pop.
+template <typename T, std::size_t capacity>
+struct Spsc_queue
+{
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+    bool push(T value)
+    {
+        const auto tail_index = tail.load(std::memory_order_relaxed);
+        if (tail_index - head.load(std::memory_order_acquire) == capacity)
+            return false;
+        slots[tail_index & (capacity - 1)] = std::move(value);
+        tail.store(tail_index + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& value)
+    {
+        const auto head_index = head.load(std::memory_order_relaxed);
+        if (head_index == tail.load(std::memory_order_acquire))
+            return false;
+        value = std::move(slots[head_index & (capacity - 1)]);
+        head.store(head_index + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::array<T, capacity> slots{};
+    alignas(64) std::atomic<std::size_t> head{};
+    alignas(64) std::atomic<std::size_t> tail{};
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers started once. parallel_for hands out indices from a shared counter,
+// so uneven tasks balance themselves, and the calling thread works alongside the pool.
+struct Thread_pool
+{
+    explicit Thread_pool(unsigned thread_count = std::thread::hardware_concurrency())
+    {
+        const unsigned worker_count = std::max(1u, thread_count) - 1;
+        for (unsigned i = 0; i < worker_count; ++i)
+            workers.emplace_back([this] { work(); });
+    }
+
+    Thread_pool(const Thread_pool&) = delete;
+    Thread_pool& operator=(const Thread_pool&) = delete;
+
+    ~Thread_pool()
+    {
+        {
+            std::lock_guard lock{ mutex };
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    std::size_t size() const
+    {
+        return workers.size() + 1;
+    }
+
+    // Calls task(i) for every i in [0, count) and returns once all calls have finished.
+    void parallel_for(std::size_t count, const std::function<void(std::size_t)>& task_)
+    {
+        {
+            std::lock_guard lock{ mutex };
+            task = &task_;
+            task_count = count;
+            next.store(0, std::memory_order_relaxed);
+            busy = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        run_tasks();
+        std::unique_lock lock{ mutex };
+        done.wait(lock, [this] { return busy == 0; });
+        task = nullptr;
+    }
+
+private:
+    void work()
+    {
+        std::uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock lock{ mutex };
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            run_tasks();
+            std::lock_guard lock{ mutex };
+            if (--busy == 0)
+                done.notify_one();
+        }
+    }
+
+    void run_tasks()
+    {
+        for (auto i = next.fetch_add(1); i < task_count; i = next.fetch_add(1))
+            (*task)(i);
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(std::size_t)>* task{};
+    std::size_t task_count{};
+    std::atomic<std::size_t> next{};
+    std::size_t busy{};
+    std::uint64_t generation{};
+    bool stopping = false;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Every tile in VRAM (384 per bank, two banks on CGB) decoded to one palette-index byte per
+// pixel, plain and mirrored horizontally. The bus marks a tile dirty when one of its 16 bytes
+// is written and it is decoded again on its next use, so the renderer reads rows of ready
+// indices instead of unpacking bit planes. Vertical flips just pick another row.
+struct Tile_cache
+{
+    static constexpr std::size_t tiles_per_bank = 384;
+    static constexpr std::size_t tile_count = tiles_per_bank * 2;
+    static constexpr std::uint16_t tile_data_size = tiles_per_bank * 16;  // 0x8000-0x97FF
+
+    using Tile = std::array<std::uint8_t, 64>;  // row-major, 8 pixels per row
+
+    std::array<std::array<Tile, 2>, tile_count> decoded{};  // [tile][mirrored]
+    std::array<std::uint64_t, tile_count / 64> dirty;
+
+    Tile_cache()
+    {
+        invalidate_all();
+    }
+
+    // offset is from 0x8000 within the bank; writes outside tile data are ignored.
+    void invalidate(std::size_t bank, std::uint16_t offset)
+    {
+        if (offset < tile_data_size)
+        {
+            const std::size_t tile = bank * tiles_per_bank + offset / 16;
+            dirty[tile / 64] |= std::uint64_t{ 1 } << (tile % 64);
+        }
+    }
+
+    void invalidate(std::size_t bank, std::uint16_t offset, std::size_t size)
+    {
+        for (std::size_t i = 0; i < size; i += 16)
+            invalidate(bank, static_cast<std::uint16_t>(offset + i));
+    }
+
+    void invalidate_all()
+    {
+        dirty.fill(~std::uint64_t{});
+    }
+
+    // Before bank's tile data is overwritten wholesale: marks only the tiles that change.
+    void invalidate_changed(std::size_t bank, const std::uint8_t* old_data, const std::uint8_t* new_data)
+    {
+        for (std::uint16_t offset = 0; offset < tile_data_size; offset += 16)
+            if (std::memcmp(old_data + offset, new_data + offset, 16) != 0)
+                invalidate(bank, offset);
+    }
+
+    // Eight indices for row y of tile (0-383, as an offset from 0x8000 divided by 16) in the
+    // given bank, whose data starts at bank_data.
+    const std::uint8_t* row(const std::uint8_t* bank_data, std::size_t bank, std::size_t tile, int y, bool mirrored)
+    {
+        const std::size_t index = bank * tiles_per_bank + tile;
+        std::uint64_t& word = dirty[index / 64];
+        const std::uint64_t bit = std::uint64_t{ 1 } << (index % 64);
+        if ((word & bit) != 0)
+        {
+            decode(bank_data + tile * 16, decoded[index]);
+            word &= ~bit;
+        }
+        return &decoded[index][mirrored][y * 8];
+    }
+
+private:
+    static void decode(const std::uint8_t* data, std::array<Tile, 2>& tile)
+    {
+        for (int y = 0; y < 8; ++y)
+        {
+            const std::uint8_t low = data[y * 2];
+            const std::uint8_t high = data[y * 2 + 1];
+            for (int x = 0; x < 8; ++x)
+            {
+                const std::uint8_t index = (low >> (7 - x) & 1) | (high >> (7 - x) & 1) << 1;
+                tile[0][y * 8 + x] = index;
+                tile[1][y * 8 + 7 - x] = index;
+            }
+        }
+    }
+};
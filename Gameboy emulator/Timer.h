@@ -0,0 +1,204 @@
+#pragma once
+
+#include "Scheduler.h"
+
+#include <array>
+#include <cstdint>
+
+// DIV/TIMA/TMA/TAC derived from the cycle counter. The 16-bit system counter is
+// (cycles << speed_shift) + counter_offset, TIMA is brought up to date only when it is
+// read or written, and the only scheduled work is a single wakeup at the next TMA reload.
+// In CGB double speed the counter runs at the CPU clock, twice per dot.
+struct Timer
+{
+    static constexpr std::uint16_t DIV = 0xFF04;
+    static constexpr std::uint16_t TIMA = 0xFF05;
+    static constexpr std::uint16_t TMA = 0xFF06;
+    static constexpr std::uint16_t TAC = 0xFF07;
+    static constexpr std::uint64_t reload_delay = 4;
+    static constexpr std::array<std::uint8_t, 4> tac_bits{ 9, 3, 5, 7 };
+
+    std::uint64_t counter_offset = 0xABCC;  // system counter after the boot ROM
+    std::uint8_t tima{};
+    std::uint8_t tma{};
+    std::uint8_t tac{};
+    std::uint64_t synced_cycle{};
+    std::uint64_t reload_cycle = Scheduler::never;
+    std::uint64_t last_reload_cycle = Scheduler::never;
+    std::uint8_t speed_shift{};
+
+    std::uint64_t clock(std::uint64_t now) const
+    {
+        return (now << speed_shift) + counter_offset;
+    }
+
+    // First cycle at which the counter has reached clock_value.
+    std::uint64_t to_cycles(std::uint64_t clock_value) const
+    {
+        return (clock_value - counter_offset + (1u << speed_shift) - 1) >> speed_shift;
+    }
+
+    std::uint16_t counter(std::uint64_t now) const
+    {
+        return static_cast<std::uint16_t>(clock(now));
+    }
+
+    bool enabled() const
+    {
+        return (tac & 0x04) != 0;
+    }
+
+    std::uint8_t selected_bit() const
+    {
+        return tac_bits[tac & 3];
+    }
+
+    // Cycle at which the given counter bit next falls after now.
+    std::uint64_t next_falling_edge(std::uint64_t now, std::uint8_t bit) const
+    {
+        return to_cycles(((clock(now) >> (bit + 1)) + 1) << (bit + 1));
+    }
+
+    // Brings TIMA up to now. Returns true if a reload happened, i.e. the timer interrupt fired.
+    bool sync(std::uint64_t now)
+    {
+        bool interrupt = false;
+        while (true)
+        {
+            if (reload_cycle != Scheduler::never)
+            {
+                if (now < reload_cycle)
+                    break;
+                tima = tma;
+                synced_cycle = reload_cycle;
+                last_reload_cycle = reload_cycle;
+                reload_cycle = Scheduler::never;
+                interrupt = true;
+            }
+            if (!enabled() || now <= synced_cycle)
+                break;
+
+            const auto shift = selected_bit() + 1;
+            const auto edges = (clock(now) >> shift) - (clock(synced_cycle) >> shift);
+            if (tima + edges <= 0xFF)
+            {
+                tima += static_cast<std::uint8_t>(edges);
+                break;
+            }
+            const auto overflow = overflow_cycle();
+            tima = 0;
+            synced_cycle = overflow;
+            reload_cycle = overflow + (reload_delay >> speed_shift);
+        }
+        if (now > synced_cycle)
+            synced_cycle = now;
+        return interrupt;
+    }
+
+    std::uint8_t read(std::uint16_t address, std::uint64_t now, bool& interrupt)
+    {
+        switch (address)
+        {
+            case DIV:
+                return counter(now) >> 8;
+            case TIMA:
+                interrupt = sync(now);
+                return tima;
+            case TMA:
+                return tma;
+            default:
+                return tac | 0xF8;
+        }
+    }
+
+    // Returns true if the write made the frame sequencer's DIV bit fall.
+    bool write(std::uint16_t address, std::uint8_t value, std::uint64_t now, Scheduler& scheduler, bool& interrupt)
+    {
+        interrupt = sync(now);
+        bool frame_sequencer_edge = false;
+        switch (address)
+        {
+            case DIV:
+            {
+                // Clearing the counter is a falling edge for any bit that was set.
+                if (enabled() && (counter(now) >> selected_bit() & 1) != 0)
+                    increment(now);
+                frame_sequencer_edge = (counter(now) >> frame_sequencer_bit() & 1) != 0;
+                counter_offset = 0 - (now << speed_shift);
+                break;
+            }
+            case TIMA:
+            {
+                if (now == last_reload_cycle)
+                    break;
+                reload_cycle = Scheduler::never;
+                tima = value;
+                break;
+            }
+            case TMA:
+            {
+                tma = value;
+                if (now == last_reload_cycle)
+                    tima = value;
+                break;
+            }
+            default:
+            {
+                // The timer clock is (enable AND selected bit); a 1 -> 0 change counts as an edge.
+                const bool before = enabled() && (counter(now) >> selected_bit() & 1) != 0;
+                tac = value & 0x07;
+                const bool after = enabled() && (counter(now) >> selected_bit() & 1) != 0;
+                if (before && !after)
+                    increment(now);
+                break;
+            }
+        }
+        schedule_wakeup(scheduler);
+        return frame_sequencer_edge;
+    }
+
+    void schedule_wakeup(Scheduler& scheduler) const
+    {
+        if (reload_cycle != Scheduler::never)
+            scheduler.schedule(Event::timer_reload, reload_cycle);
+        else if (enabled())
+            scheduler.schedule(Event::timer_reload, overflow_cycle() + (reload_delay >> speed_shift));
+        else
+            scheduler.cancel(Event::timer_reload);
+    }
+
+    // DIV bit whose falling edge clocks the APU frame sequencer.
+    std::uint8_t frame_sequencer_bit() const
+    {
+        return 12 + speed_shift;
+    }
+
+    // Called on a CGB speed switch; the counter value carries over.
+    void set_speed(std::uint8_t shift, std::uint64_t now, Scheduler& scheduler, bool& interrupt)
+    {
+        interrupt = sync(now);
+        const auto value = clock(now);
+        speed_shift = shift;
+        counter_offset = value - (now << speed_shift);
+        schedule_wakeup(scheduler);
+    }
+
+private:
+    // Cycle at which TIMA wraps if left alone from synced_cycle.
+    std::uint64_t overflow_cycle() const
+    {
+        const auto shift = selected_bit() + 1;
+        return to_cycles(((clock(synced_cycle) >> shift) + 1 + (0xFF - tima)) << shift);
+    }
+
+    void increment(std::uint64_t now)
+    {
+        if (tima == 0xFF)
+        {
+            tima = 0;
+            reload_cycle = now + (reload_delay >> speed_shift);
+        }
+        else
+            ++tima;
+    }
+};
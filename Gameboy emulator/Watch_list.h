@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Dma.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+struct Watch
+{
+    std::uint16_t address{};
+    std::uint8_t size = 1;  // 1-4 bytes, little-endian
+};
+
+// Game variables sampled once per frame, at VBlank. values[i] belongs to watches[i] and
+// holds what the bus had mapped at that address when frame `frame` finished. Reads go
+// straight through the page table, so they see the current banks and trigger no I/O.
+struct Watch_list
+{
+    std::vector<Watch> watches;
+    std::vector<std::uint32_t> values;
+    std::uint64_t frame{};
+
+    std::size_t add(std::uint16_t address, std::uint8_t size = 1)
+    {
+        if (size < 1 || size > 4)
+            throw std::invalid_argument("watch size must be 1-4 bytes");
+        watches.push_back({ address, size });
+        values.push_back(0);
+        return watches.size() - 1;
+    }
+
+    void clear()
+    {
+        watches.clear();
+        values.clear();
+    }
+
+    void gather(const Page_table& pages, std::uint64_t frame_)
+    {
+        frame = frame_;
+        for (std::size_t i = 0; i < watches.size(); ++i)
+        {
+            std::uint32_t value = 0;
+            for (std::uint8_t byte = 0; byte < watches[i].size; ++byte)
+            {
+                const std::uint16_t address = watches[i].address + byte;
+                value |= static_cast<std::uint32_t>(pages[address >> 8][address & 0xFF]) << (byte * 8);
+            }
+            values[i] = value;
+        }
+    }
+};
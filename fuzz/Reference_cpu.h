@@ -0,0 +1,484 @@
+#pragma once
+
+#include <cstdint>
+
+// A second, deliberately independent SM83 model for differential fuzzing. Where Cpu_state
+// has a case per opcode, this decodes the x/y/z/p/q bit fields of the opcode byte and shares
+// one implementation per operation, so the two rarely share a mistake. It knows nothing about
+// timing or hardware: Bus supplies read(address) and write(address, value), and step returns
+// the instruction's length in 4.19 MHz clock cycles.
+struct Reference_cpu
+{
+    enum Flag : std::uint8_t
+    {
+        z = 0x80,
+        n = 0x40,
+        h = 0x20,
+        c = 0x10
+    };
+
+    std::uint8_t a{}, f{}, b{}, c_{}, d{}, e{}, h_{}, l{};
+    std::uint16_t sp{};
+    std::uint16_t pc{};
+    bool ime = false;
+    bool halted = false;
+    bool stopped = false;
+    bool illegal = false;  // executed one of the 11 unused opcodes, which lock up the CPU
+
+    std::uint16_t bc() const { return b << 8 | c_; }
+    std::uint16_t de() const { return d << 8 | e; }
+    std::uint16_t hl() const { return h_ << 8 | l; }
+    std::uint16_t af() const { return a << 8 | f; }
+    void set_bc(std::uint16_t value) { b = value >> 8; c_ = value & 0xFF; }
+    void set_de(std::uint16_t value) { d = value >> 8; e = value & 0xFF; }
+    void set_hl(std::uint16_t value) { h_ = value >> 8; l = value & 0xFF; }
+    void set_af(std::uint16_t value) { a = value >> 8; f = value & 0xF0; }
+
+    template <typename Bus>
+    int step(Bus& bus)
+    {
+        const std::uint8_t op = fetch(bus);
+        const int x = op >> 6;
+        const int y = op >> 3 & 7;
+        const int z = op & 7;
+        const int p = y >> 1;
+        const int q = y & 1;
+
+        if (x == 1)
+        {
+            if (op == 0x76)
+            {
+                halted = true;
+                return 4;
+            }
+            set_r(bus, y, get_r(bus, z));
+            return y == 6 || z == 6 ? 8 : 4;
+        }
+        if (x == 2)
+        {
+            alu(y, get_r(bus, z));
+            return z == 6 ? 8 : 4;
+        }
+        if (x == 0)
+            return block0(bus, y, z, p, q);
+        return block3(bus, y, z, p, q);
+    }
+
+private:
+    template <typename Bus>
+    std::uint8_t fetch(Bus& bus)
+    {
+        return bus.read(pc++);
+    }
+
+    template <typename Bus>
+    std::uint16_t fetch16(Bus& bus)
+    {
+        const std::uint8_t low = fetch(bus);
+        return low | fetch(bus) << 8;
+    }
+
+    template <typename Bus>
+    std::uint8_t get_r(Bus& bus, int index)
+    {
+        switch (index)
+        {
+            case 0: return b;
+            case 1: return c_;
+            case 2: return d;
+            case 3: return e;
+            case 4: return h_;
+            case 5: return l;
+            case 6: return bus.read(hl());
+            default: return a;
+        }
+    }
+
+    template <typename Bus>
+    void set_r(Bus& bus, int index, std::uint8_t value)
+    {
+        switch (index)
+        {
+            case 0: b = value; break;
+            case 1: c_ = value; break;
+            case 2: d = value; break;
+            case 3: e = value; break;
+            case 4: h_ = value; break;
+            case 5: l = value; break;
+            case 6: bus.write(hl(), value); break;
+            default: a = value; break;
+        }
+    }
+
+    std::uint16_t get_rp(int index) const
+    {
+        switch (index)
+        {
+            case 0: return bc();
+            case 1: return de();
+            case 2: return hl();
+            default: return sp;
+        }
+    }
+
+    void set_rp(int index, std::uint16_t value)
+    {
+        switch (index)
+        {
+            case 0: set_bc(value); break;
+            case 1: set_de(value); break;
+            case 2: set_hl(value); break;
+            default: sp = value; break;
+        }
+    }
+
+    bool condition(int index) const
+    {
+        switch (index)
+        {
+            case 0: return !(f & z);
+            case 1: return (f & z) != 0;
+            case 2: return !(f & c);
+            default: return (f & c) != 0;
+        }
+    }
+
+    void set_flags(bool zero, bool subtract, bool half, bool carry)
+    {
+        f = (zero ? z : 0) | (subtract ? n : 0) | (half ? h : 0) | (carry ? c : 0);
+    }
+
+    template <typename Bus>
+    void push(Bus& bus, std::uint16_t value)
+    {
+        bus.write(--sp, value >> 8);
+        bus.write(--sp, value & 0xFF);
+    }
+
+    template <typename Bus>
+    std::uint16_t pop(Bus& bus)
+    {
+        const std::uint8_t low = bus.read(sp++);
+        return low | bus.read(sp++) << 8;
+    }
+
+    void alu(int operation, std::uint8_t value)
+    {
+        const int carry_in = (f & c) && (operation == 1 || operation == 3) ? 1 : 0;
+        switch (operation)
+        {
+            case 0:
+            case 1:
+            {
+                const int sum = a + value + carry_in;
+                set_flags((sum & 0xFF) == 0, false, (a & 0xF) + (value & 0xF) + carry_in > 0xF, sum > 0xFF);
+                a = static_cast<std::uint8_t>(sum);
+                break;
+            }
+            case 2:
+            case 3:
+            case 7:
+            {
+                const int difference = a - value - carry_in;
+                set_flags((difference & 0xFF) == 0, true, (a & 0xF) - (value & 0xF) - carry_in < 0, difference < 0);
+                if (operation != 7)
+                    a = static_cast<std::uint8_t>(difference);
+                break;
+            }
+            case 4:
+                a &= value;
+                set_flags(a == 0, false, true, false);
+                break;
+            case 5:
+                a ^= value;
+                set_flags(a == 0, false, false, false);
+                break;
+            default:
+                a |= value;
+                set_flags(a == 0, false, false, false);
+                break;
+        }
+    }
+
+    // Shared by the CB-prefixed rotates (zero from the result) and RLCA/RRCA/RLA/RRA (zero clear).
+    std::uint8_t rotate(int operation, std::uint8_t value)
+    {
+        const bool carry_in = (f & c) != 0;
+        bool carry_out = false;
+        std::uint8_t result = 0;
+        switch (operation)
+        {
+            case 0: carry_out = value & 0x80; result = value << 1 | value >> 7; break;           // RLC
+            case 1: carry_out = value & 0x01; result = value >> 1 | value << 7; break;           // RRC
+            case 2: carry_out = value & 0x80; result = value << 1 | (carry_in ? 1 : 0); break;   // RL
+            case 3: carry_out = value & 0x01; result = value >> 1 | (carry_in ? 0x80 : 0); break; // RR
+            case 4: carry_out = value & 0x80; result = value << 1; break;                        // SLA
+            case 5: carry_out = value & 0x01; result = (value >> 1) | (value & 0x80); break;     // SRA
+            case 6: result = value << 4 | value >> 4; break;                                     // SWAP
+            default: carry_out = value & 0x01; result = value >> 1; break;                       // SRL
+        }
+        set_flags(result == 0, false, false, carry_out);
+        return result;
+    }
+
+    void daa()
+    {
+        int adjust = 0;
+        bool carry = (f & c) != 0;
+        if (f & n)
+        {
+            if (f & h)
+                adjust |= 0x06;
+            if (carry)
+                adjust |= 0x60;
+            a = static_cast<std::uint8_t>(a - adjust);
+        }
+        else
+        {
+            if ((f & h) || (a & 0x0F) > 0x09)
+                adjust |= 0x06;
+            if (carry || a > 0x99)
+            {
+                adjust |= 0x60;
+                carry = true;
+            }
+            a = static_cast<std::uint8_t>(a + adjust);
+        }
+        f = (a == 0 ? z : 0) | (f & n) | (carry ? c : 0);
+    }
+
+    std::uint16_t add_sp_offset(std::int8_t offset)
+    {
+        const int unsigned_offset = static_cast<std::uint8_t>(offset);
+        set_flags(false, false, (sp & 0xF) + (unsigned_offset & 0xF) > 0xF, (sp & 0xFF) + unsigned_offset > 0xFF);
+        return static_cast<std::uint16_t>(sp + offset);
+    }
+
+    template <typename Bus>
+    int block0(Bus& bus, int y, int z_, int p, int q)
+    {
+        switch (z_)
+        {
+            case 0:
+                if (y == 0)
+                    return 4;
+                if (y == 1)
+                {
+                    const std::uint16_t address = fetch16(bus);
+                    bus.write(address, sp & 0xFF);
+                    bus.write(static_cast<std::uint16_t>(address + 1), sp >> 8);
+                    return 20;
+                }
+                if (y == 2)
+                {
+                    ++pc;
+                    stopped = true;
+                    return 4;
+                }
+                {
+                    const auto offset = static_cast<std::int8_t>(fetch(bus));
+                    if (y == 3 || condition(y - 4))
+                    {
+                        pc = static_cast<std::uint16_t>(pc + offset);
+                        return 12;
+                    }
+                    return 8;
+                }
+            case 1:
+                if (q == 0)
+                {
+                    set_rp(p, fetch16(bus));
+                    return 12;
+                }
+                else
+                {
+                    const int sum = hl() + get_rp(p);
+                    f = (f & z) | ((hl() & 0xFFF) + (get_rp(p) & 0xFFF) > 0xFFF ? h : 0) | (sum > 0xFFFF ? c : 0);
+                    set_hl(static_cast<std::uint16_t>(sum));
+                    return 8;
+                }
+            case 2:
+            {
+                std::uint16_t address = p == 0 ? bc() : p == 1 ? de() : hl();
+                if (q == 0)
+                    bus.write(address, a);
+                else
+                    a = bus.read(address);
+                if (p == 2)
+                    set_hl(hl() + 1);
+                else if (p == 3)
+                    set_hl(hl() - 1);
+                return 8;
+            }
+            case 3:
+                set_rp(p, static_cast<std::uint16_t>(get_rp(p) + (q == 0 ? 1 : -1)));
+                return 8;
+            case 4:
+            {
+                const std::uint8_t value = get_r(bus, y) + 1;
+                set_r(bus, y, value);
+                f = (value == 0 ? z : 0) | ((value & 0xF) == 0 ? h : 0) | (f & c);
+                return y == 6 ? 12 : 4;
+            }
+            case 5:
+            {
+                const std::uint8_t value = get_r(bus, y) - 1;
+                set_r(bus, y, value);
+                f = (value == 0 ? z : 0) | n | ((value & 0xF) == 0xF ? h : 0) | (f & c);
+                return y == 6 ? 12 : 4;
+            }
+            case 6:
+                set_r(bus, y, fetch(bus));
+                return y == 6 ? 12 : 8;
+            default:
+                switch (y)
+                {
+                    case 4: daa(); break;
+                    case 5: a = ~a; f |= n | h; break;
+                    case 6: f = (f & z) | c; break;
+                    case 7: f = (f & z) | (f & c ? 0 : c); break;
+                    default: a = rotate(y, a); f &= ~z; break;
+                }
+                return 4;
+        }
+    }
+
+    template <typename Bus>
+    int block3(Bus& bus, int y, int z_, int p, int q)
+    {
+        switch (z_)
+        {
+            case 0:
+                if (y < 4)
+                {
+                    if (!condition(y))
+                        return 8;
+                    pc = pop(bus);
+                    return 20;
+                }
+                if (y == 4 || y == 6)
+                {
+                    const std::uint16_t address = 0xFF00 | fetch(bus);
+                    if (y == 4)
+                        bus.write(address, a);
+                    else
+                        a = bus.read(address);
+                    return 12;
+                }
+                {
+                    const auto offset = static_cast<std::int8_t>(fetch(bus));
+                    const std::uint16_t result = add_sp_offset(offset);
+                    if (y == 5)
+                    {
+                        sp = result;
+                        return 16;
+                    }
+                    set_hl(result);
+                    return 12;
+                }
+            case 1:
+                if (q == 0)
+                {
+                    const std::uint16_t value = pop(bus);
+                    if (p == 3)
+                        set_af(value);
+                    else
+                        set_rp(p, value);
+                    return 12;
+                }
+                switch (p)
+                {
+                    case 0: pc = pop(bus); return 16;
+                    case 1: pc = pop(bus); ime = true; return 16;
+                    case 2: pc = hl(); return 4;
+                    default: sp = hl(); return 8;
+                }
+            case 2:
+                if (y < 4)
+                {
+                    const std::uint16_t target = fetch16(bus);
+                    if (!condition(y))
+                        return 12;
+                    pc = target;
+                    return 16;
+                }
+                {
+                    const std::uint16_t address = y == 4 || y == 6 ? 0xFF00 | c_ : fetch16(bus);
+                    if (y == 4 || y == 5)
+                        bus.write(address, a);
+                    else
+                        a = bus.read(address);
+                    return y == 4 || y == 6 ? 8 : 16;
+                }
+            case 3:
+                switch (y)
+                {
+                    case 0: pc = fetch16(bus); return 16;
+                    case 1: return prefix_cb(bus);
+                    case 6: ime = false; return 4;
+                    case 7: ime = true; return 4;
+                    default: illegal = true; return 0;
+                }
+            case 4:
+                if (y < 4)
+                {
+                    const std::uint16_t target = fetch16(bus);
+                    if (!condition(y))
+                        return 12;
+                    push(bus, pc);
+                    pc = target;
+                    return 24;
+                }
+                illegal = true;
+                return 0;
+            case 5:
+                if (q == 0)
+                {
+                    push(bus, p == 3 ? af() : get_rp(p));
+                    return 16;
+                }
+                if (p == 0)
+                {
+                    const std::uint16_t target = fetch16(bus);
+                    push(bus, pc);
+                    pc = target;
+                    return 24;
+                }
+                illegal = true;
+                return 0;
+            case 6:
+                alu(y, fetch(bus));
+                return 8;
+            default:
+                push(bus, pc);
+                pc = static_cast<std::uint16_t>(y * 8);
+                return 16;
+        }
+    }
+
+    template <typename Bus>
+    int prefix_cb(Bus& bus)
+    {
+        const std::uint8_t op = fetch(bus);
+        const int x = op >> 6;
+        const int y = op >> 3 & 7;
+        const int z_ = op & 7;
+        const std::uint8_t value = get_r(bus, z_);
+        switch (x)
+        {
+            case 0:
+                set_r(bus, z_, rotate(y, value));
+                break;
+            case 1:
+                f = (value & 1 << y ? 0 : z) | h | (f & c);
+                return z_ == 6 ? 12 : 8;
+            case 2:
+                set_r(bus, z_, value & ~(1 << y));
+                break;
+            default:
+                set_r(bus, z_, value | 1 << y);
+                break;
+        }
+        return z_ == 6 ? 16 : 8;
+    }
+};
@@ -0,0 +1,253 @@
+// Differential fuzz target for the CPU core.
+//
+// libFuzzer:   clang++ -std=c++20 -g -O1 -fsanitize=fuzzer,address,undefined -I"../Gameboy emulator" cpu_fuzzer.cpp -o cpu_fuzzer
+// Standalone:  g++ -std=c++20 -g -O1 -fsanitize=address,undefined -DGB_FUZZ_STANDALONE -I"../Gameboy emulator" cpu_fuzzer.cpp -o cpu_fuzzer
+//              ./cpu_fuzzer [--runs=N] [--seed=S] [crash files...]
+//
+// Input: AF, BC, DE, HL, SP (little-endian), a 16-bit cycle budget in units of 4 cycles,
+// then code, which is repeated over the whole ROM area and copied to WRAM. Execution starts
+// at 0x0100. After every instruction Cpu_state is checked against Reference_cpu: registers,
+// elapsed cycles and every byte written, plus the invariant that the low nibble of F is 0.
+// Steps whose outcome depends on hardware the reference does not model (I/O and OAM accesses,
+// interrupt dispatch, HALT, EI's delay, OAM DMA) are not compared; the reference is reloaded
+// from the core afterwards instead.
+
+#include "Cpu_state.h"
+#include "Reference_cpu.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+namespace
+{
+    constexpr std::size_t header_size = 12;
+    constexpr std::uint16_t entry_point = 0x0100;
+    constexpr int max_steps = 4096;
+
+    bool illegal_opcode(std::uint8_t opcode)
+    {
+        switch (opcode)
+        {
+            case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB:
+            case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // OAM, unusable space and I/O registers: their contents depend on the PPU, timer and DMA.
+    bool hardware_address(std::uint16_t address)
+    {
+        return address >= 0xFE00 && (address < 0xFF80 || address == 0xFFFF);
+    }
+
+    std::uint16_t resolve(std::uint16_t address)
+    {
+        return address >= 0xE000 && address < 0xFE00 ? address - 0x2000 : address;
+    }
+
+    // The reference's view of memory: a flat copy of the core's, with echo RAM folded onto WRAM.
+    struct Mirror_bus
+    {
+        std::array<std::uint8_t, 0x10000>& memory;
+        Cpu_state& cpu;
+        bool touched_hardware = false;
+        std::array<std::uint16_t, 4> writes{};
+        std::size_t write_count = 0;
+
+        std::uint8_t read(std::uint16_t address)
+        {
+            if (hardware_address(address))
+            {
+                touched_hardware = true;
+                return cpu.peek(address);
+            }
+            return memory[resolve(address)];
+        }
+
+        void write(std::uint16_t address, std::uint8_t value)
+        {
+            if (hardware_address(address))
+            {
+                touched_hardware = true;
+                return;
+            }
+            memory[resolve(address)] = value;
+            writes[write_count++] = resolve(address);
+        }
+    };
+
+    std::uint8_t core_byte(const Cpu_state& cpu, std::uint16_t address)
+    {
+        return cpu.pages[address >> 8][address & 0xFF];
+    }
+
+    void load_reference(Reference_cpu& reference, std::array<std::uint8_t, 0x10000>& memory, const Cpu_state& cpu)
+    {
+        const Registers& registers = cpu.registers;
+        reference.set_af(registers.accumulator_and_flags);
+        reference.set_bc(registers.BC);
+        reference.set_de(registers.DE);
+        reference.set_hl(registers.HL);
+        reference.sp = registers.stack_pointer;
+        reference.pc = registers.program_counter;
+        reference.halted = false;
+        reference.stopped = false;
+        for (std::size_t page = 0; page < 0x100; ++page)
+            std::memcpy(&memory[page << 8], cpu.pages[page], 0x100);
+    }
+
+    [[noreturn]] void report(const char* what, std::uint8_t opcode, const Reference_cpu& before, const Reference_cpu& reference, const Cpu_state& cpu)
+    {
+        const Registers& registers = cpu.registers;
+        std::fprintf(stderr, "%s after opcode %02X at %04X\n", what, opcode, before.pc);
+        std::fprintf(stderr, "  before:    AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X\n", before.af(), before.bc(), before.de(), before.hl(), before.sp);
+        std::fprintf(stderr, "  reference: AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X\n", reference.af(), reference.bc(), reference.de(), reference.hl(), reference.sp, reference.pc);
+        std::fprintf(stderr, "  core:      AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X\n", registers.accumulator_and_flags, registers.BC, registers.DE, registers.HL, registers.stack_pointer, registers.program_counter);
+        std::abort();
+    }
+
+    bool same_registers(const Reference_cpu& reference, const Registers& registers)
+    {
+        return reference.af() == registers.accumulator_and_flags && reference.bc() == registers.BC && reference.de() == registers.DE
+            && reference.hl() == registers.HL && reference.sp == registers.stack_pointer && reference.pc == registers.program_counter;
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+    if (size <= header_size)
+        return 0;
+
+    const auto cpu = std::make_unique<Cpu_state>();
+    const auto read16 = [&](std::size_t offset) { return static_cast<std::uint16_t>(data[offset] | data[offset + 1] << 8); };
+    const std::uint8_t* code = data + header_size;
+    const std::size_t code_size = size - header_size;
+    for (std::size_t address = 0; address < 0x8000; ++address)
+        cpu->memory[address] = code[(address + code_size - entry_point % code_size) % code_size];
+    for (std::size_t i = 0; i < 0x2000; ++i)
+        cpu->memory[0xC000 + i] = code[i % code_size];
+
+    Registers& registers = cpu->registers;
+    registers.accumulator_and_flags = read16(0) & 0xFFF0;
+    registers.BC = read16(2);
+    registers.DE = read16(4);
+    registers.HL = read16(6);
+    registers.stack_pointer = read16(8);
+    registers.program_counter = entry_point;
+    const std::uint64_t cycle_budget = (read16(10) + 1ull) * 4;
+
+    auto memory = std::make_unique<std::array<std::uint8_t, 0x10000>>();
+    Reference_cpu reference;
+    load_reference(reference, *memory, *cpu);
+
+    for (int step = 0; step < max_steps && cpu->cycles < cycle_budget; ++step)
+    {
+        const std::uint8_t opcode = core_byte(*cpu, registers.program_counter);
+        if (illegal_opcode(opcode) && !cpu->interrupts.pending)
+            break;
+        if (cpu->interrupts.halted && cpu->interrupts.enable == 0)
+            break;
+
+        const bool comparable = !cpu->interrupts.pending && !cpu->dma.oam_active;
+        const Reference_cpu before = reference;
+        Mirror_bus bus{ *memory, *cpu };
+        int expected_cycles = 0;
+        if (comparable)
+            expected_cycles = reference.step(bus);
+
+        const std::uint64_t start = cpu->cycles;
+        cpu->run_for(1);
+
+        if ((registers.accumulator_and_flags & 0x0F) != 0)
+            report("low nibble of F set", opcode, before, reference, *cpu);
+
+        if (!comparable || bus.touched_hardware || reference.halted || reference.stopped || cpu->dma.oam_active)
+        {
+            load_reference(reference, *memory, *cpu);
+            continue;
+        }
+        if (!same_registers(reference, registers))
+            report("register mismatch", opcode, before, reference, *cpu);
+        if (cpu->cycles - start != static_cast<std::uint64_t>(expected_cycles))
+        {
+            std::fprintf(stderr, "cycles: reference %d, core %llu\n", expected_cycles, static_cast<unsigned long long>(cpu->cycles - start));
+            report("cycle mismatch", opcode, before, reference, *cpu);
+        }
+        for (std::size_t i = 0; i < bus.write_count; ++i)
+        {
+            const std::uint16_t address = bus.writes[i];
+            if ((*memory)[address] != core_byte(*cpu, address))
+            {
+                std::fprintf(stderr, "byte at %04X: reference %02X, core %02X\n", address, (*memory)[address], core_byte(*cpu, address));
+                report("memory mismatch", opcode, before, reference, *cpu);
+            }
+        }
+    }
+
+    // Catches stray writes the reference never made. Echo RAM is covered through WRAM.
+    for (std::size_t address = 0; address < 0xE000; ++address)
+    {
+        if ((*memory)[address] != core_byte(*cpu, static_cast<std::uint16_t>(address)))
+        {
+            std::fprintf(stderr, "byte at %04zX differs at the end of the run: reference %02X, core %02X\n",
+                address, (*memory)[address], core_byte(*cpu, static_cast<std::uint16_t>(address)));
+            std::abort();
+        }
+    }
+    return 0;
+}
+
+#ifdef GB_FUZZ_STANDALONE
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+// Without libFuzzer: replays the files given, or runs uniformly random inputs.
+int main(int argc, char** argv)
+{
+    std::uint64_t runs = 10000;
+    std::uint64_t seed = 1;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], "--runs=", 7) == 0)
+            runs = std::strtoull(argv[i] + 7, nullptr, 10);
+        else if (std::strncmp(argv[i], "--seed=", 7) == 0)
+            seed = std::strtoull(argv[i] + 7, nullptr, 10);
+        else
+            files.emplace_back(argv[i]);
+    }
+
+    for (const auto& file : files)
+    {
+        std::ifstream stream{ file, std::ios::binary };
+        const std::vector<std::uint8_t> input{ std::istreambuf_iterator<char>{ stream }, {} };
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    if (!files.empty())
+        return 0;
+
+    std::mt19937_64 random{ seed };
+    std::vector<std::uint8_t> input;
+    for (std::uint64_t run = 0; run < runs; ++run)
+    {
+        input.resize(header_size + 1 + random() % 256);
+        for (auto& byte : input)
+            byte = static_cast<std::uint8_t>(random());
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    std::cout << runs << " runs passed\n";
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Randomised check of Rewind_buffer against a plain stack of every state pushed: runs of pushes
+// and pops, often rewinding all the way to empty, in a budget small enough that deltas wrap,
+// evict each other and sometimes do not fit at all. Every popped state must be the matching
+// push. Prints the first mismatch and exits non-zero.
+//
+// Build:  g++ -std=c++20 -g -O1 -fsanitize=address,undefined -I"../Gameboy emulator" rewind_buffer_check.cpp -o rewind_buffer_check
+// Run:    ./rewind_buffer_check
+
+#include "Rewind_buffer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace
+{
+    std::uint64_t random_state = 0x9E3779B97F4A7C15;
+
+    std::uint64_t next_random()
+    {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return random_state;
+    }
+
+    using State_bytes = std::vector<std::uint8_t>;
+}
+
+int main()
+{
+    constexpr std::size_t state_size = sizeof(Savestate);
+    auto state = std::make_unique<Savestate>();
+    auto* bytes = reinterpret_cast<std::uint8_t*>(state.get());
+
+    for (const std::size_t budget : { std::size_t{ 400 }, std::size_t{ 4096 } })
+    {
+        Rewind_buffer buffer(16, budget);
+        std::vector<State_bytes> pushed;  // newest last; trimmed to what the buffer still holds
+        std::memset(bytes, 0, state_size);
+
+        for (int round = 0; round < 2000; ++round)
+        {
+            const std::size_t pushes = next_random() % 24;
+            for (std::size_t i = 0; i < pushes; ++i)
+            {
+                // Mostly a few changed bytes, now and then enough that the delta fills the budget
+                const std::size_t changes = next_random() % 8 == 0 ? next_random() % 256 : next_random() % 8;
+                for (std::size_t j = 0; j < changes; ++j)
+                    bytes[next_random() % state_size] ^= static_cast<std::uint8_t>(next_random() | 1);
+                buffer.push(*state);
+                pushed.emplace_back(bytes, bytes + state_size);
+            }
+
+            // Rewind to empty about one round in four
+            const std::size_t pops = next_random() % 4 == 0 ? pushed.size() + 1 : next_random() % 24;
+            for (std::size_t i = 0; i < pops; ++i)
+            {
+                if (buffer.size() < pushed.size())
+                    pushed.erase(pushed.begin(), pushed.end() - buffer.size());
+                const bool popped = buffer.pop(*state);
+                if (popped != !pushed.empty())
+                {
+                    std::printf("budget %zu, round %d: pop returned %d with %zu states expected\n", budget, round, popped, pushed.size());
+                    return 1;
+                }
+                if (!popped)
+                    break;
+                if (std::memcmp(bytes, pushed.back().data(), state_size) != 0)
+                {
+                    std::printf("budget %zu, round %d: popped state differs from the one pushed\n", budget, round);
+                    return 1;
+                }
+                pushed.pop_back();
+            }
+            // Carry on from the newest state left, or from the last popped
+            if (!pushed.empty())
+                std::memcpy(bytes, pushed.back().data(), state_size);
+        }
+    }
+    std::printf("All rewind states match\n");
+    return 0;
+}
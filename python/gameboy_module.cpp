@@ -0,0 +1,162 @@
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+
+#include "Batch_runner.h"
+#include "Cpu_state.h"
+#include "Observation.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace py = pybind11;
+
+namespace
+{
+    // Arrays returned to Python point into the instance and keep it alive through `owner`.
+    template <typename T>
+    py::array_t<T> view(T* data, std::vector<py::ssize_t> shape, py::handle owner)
+    {
+        return py::array_t<T>(shape, data, owner);
+    }
+
+    void load_rom(Cpu_state& cpu, const py::bytes& rom)
+    {
+        const std::string data = rom;
+        cpu.load_rom(reinterpret_cast<const std::uint8_t*>(data.data()), data.size());
+    }
+
+    py::bytes save_state(const Cpu_state& cpu)
+    {
+        const auto state = std::make_unique<Savestate>();
+        cpu.save_state(*state);
+        return py::bytes(reinterpret_cast<const char*>(state.get()), sizeof(Savestate));
+    }
+
+    void load_state(Cpu_state& cpu, const py::bytes& bytes)
+    {
+        const std::string data = bytes;
+        if (data.size() != sizeof(Savestate))
+            throw std::invalid_argument("state was saved by a different build");
+        const auto state = std::make_unique<Savestate>();
+        std::memcpy(state.get(), data.data(), sizeof(Savestate));
+        cpu.load_state(*state);
+    }
+
+    // Batched environment: one instance per slot, stepped together on the native thread pool
+    // with the GIL released. Observations land in one (count, height, width) array that is
+    // allocated once and shared with Python.
+    struct Vector_env
+    {
+        std::size_t width;
+        std::size_t height;
+        Batch_runner runner;
+        std::vector<Observer> observers;  // one each: an Observer keeps scratch rows
+        std::vector<std::uint8_t> observations;
+
+        Vector_env(std::size_t count, unsigned thread_count, std::size_t width_, std::size_t height_)
+            : width{ width_ }, height{ height_ }, runner{ thread_count != 0 ? thread_count : std::thread::hardware_concurrency() },
+              observers(count, Observer{ width_, height_ }), observations(count * width_ * height_)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                runner.add_instance().set_audio_muted(true);
+        }
+
+        void step(const std::uint8_t* actions, std::uint64_t frame_count)
+        {
+            runner.step(actions, frame_count, [&](std::size_t i, Cpu_state& cpu)
+            {
+                observers[i].observe(cpu.frames.acquire(), &observations[i * width * height]);
+            });
+        }
+    };
+}
+
+PYBIND11_MODULE(gameboy, m)
+{
+    m.doc() = "Game Boy / Game Boy Color emulator core";
+
+    py::class_<Cpu_state>(m, "Emulator")
+        .def(py::init<>())
+        .def("load_rom", &load_rom)
+        .def("step", [](Cpu_state& cpu, std::uint64_t frames) { cpu.run_frames(frames); },
+            py::arg("frames") = 1, py::call_guard<py::gil_scoped_release>())
+        .def("run_cycles", [](Cpu_state& cpu, std::uint64_t cycles) { cpu.run_for(cycles); },
+            py::call_guard<py::gil_scoped_release>())
+        .def("set_input", &Cpu_state::set_input, py::arg("buttons"))
+        .def("save_state", &save_state)
+        .def("load_state", &load_state)
+        .def("set_audio_muted", &Cpu_state::set_audio_muted)
+        .def("set_turbo", &Cpu_state::set_turbo, py::arg("enabled"), py::arg("render_interval") = 8)
+        .def("set_threaded_rendering", &Cpu_state::set_threaded_rendering, py::arg("enabled"))
+        .def("set_run_ahead", &Cpu_state::set_run_ahead, py::arg("frames"))
+        // Raises ValueError unless size is 1-4
+        .def("watch", [](Cpu_state& cpu, std::uint16_t address, std::uint8_t size) { return cpu.watch_list.add(address, size); },
+            py::arg("address"), py::arg("size") = 1)
+        .def_property_readonly("frame_count", [](const Cpu_state& cpu) { return cpu.frame_count; })
+        .def_property_readonly("cycles", [](const Cpu_state& cpu) { return cpu.cycles; })
+        .def_property_readonly("cgb", [](const Cpu_state& cpu) { return cpu.cgb; })
+        // The latest completed frame as a (144, 160) array of 0xAARRGGBB. It shares memory
+        // with the frame pipeline and is reused once later frames are taken.
+        .def_property_readonly("frame", [](py::object self)
+        {
+            auto frame = self.cast<Cpu_state&>().frames.acquire();
+            return view(const_cast<std::uint32_t*>(frame.pixels.data()), { Frame::height, Frame::width }, self);
+        })
+        .def_property_readonly("wram", [](py::object self) { return view(self.cast<Cpu_state&>().wram().data(), { 0x2000 }, self); })
+        .def_property_readonly("hram", [](py::object self) { return view(self.cast<Cpu_state&>().hram().data(), { 0x7F }, self); })
+        .def_property_readonly("cartridge_ram", [](py::object self) { return view(self.cast<Cpu_state&>().cartridge_ram().data(), { 0x2000 }, self); })
+        // Values of the watched addresses as of the last frame. A copy rather than a view:
+        // adding a watch can move the values.
+        .def_property_readonly("watched", [](const Cpu_state& cpu)
+        {
+            const auto& values = cpu.watch_list.values;
+            py::array_t<std::uint32_t> copy(static_cast<py::ssize_t>(values.size()));
+            std::memcpy(copy.mutable_data(), values.data(), values.size() * sizeof(std::uint32_t));
+            return copy;
+        });
+
+    py::class_<Vector_env>(m, "VectorEnv")
+        .def(py::init<std::size_t, unsigned, std::size_t, std::size_t>(),
+            py::arg("count"), py::arg("threads") = 0, py::arg("width") = 84, py::arg("height") = 84)
+        .def("__len__", [](const Vector_env& env) { return env.runner.instances.size(); })
+        .def("load_rom", [](Vector_env& env, const py::bytes& rom)
+        {
+            for (auto& instance : env.runner.instances)
+                load_rom(*instance, rom);
+        })
+        // actions: uint8 array with one button mask per instance. Returns the shared
+        // (count, height, width) observation array, rewritten on every step.
+        .def("step", [](py::object self, py::array_t<std::uint8_t, py::array::c_style | py::array::forcecast> actions, std::uint64_t frames)
+        {
+            auto& env = self.cast<Vector_env&>();
+            if (static_cast<std::size_t>(actions.size()) != env.runner.instances.size())
+                throw std::invalid_argument("need one action per instance");
+            {
+                py::gil_scoped_release release;
+                env.step(actions.data(), frames);
+            }
+            return view(env.observations.data(), { static_cast<py::ssize_t>(env.runner.instances.size()),
+                static_cast<py::ssize_t>(env.height), static_cast<py::ssize_t>(env.width) }, self);
+        }, py::arg("actions"), py::arg("frames") = 1)
+        .def("save_state", [](const Vector_env& env, std::size_t index) { return save_state(*env.runner.instances.at(index)); })
+        .def("load_state", [](Vector_env& env, std::size_t index, const py::bytes& state) { load_state(*env.runner.instances.at(index), state); })
+        .def("wram", [](py::object self, std::size_t index)
+        {
+            return view(self.cast<Vector_env&>().runner.instances.at(index)->wram().data(), { 0x2000 }, self);
+        });
+
+    py::enum_<Joypad::Button>(m, "Button", py::arithmetic())
+        .value("RIGHT", Joypad::right)
+        .value("LEFT", Joypad::left)
+        .value("UP", Joypad::up)
+        .value("DOWN", Joypad::down)
+        .value("A", Joypad::a)
+        .value("B", Joypad::b)
+        .value("SELECT", Joypad::select)
+        .value("START", Joypad::start);
+}
@@ -0,0 +1,15 @@
+import os
+
+from pybind11.setup_helpers import Pybind11Extension, build_ext
+from setuptools import setup
+
+core = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "Gameboy emulator")
+
+setup(
+    name="gameboy",
+    version="0.1.0",
+    ext_modules=[
+        Pybind11Extension("gameboy", ["gameboy_module.cpp"], include_dirs=[core], cxx_std=20),
+    ],
+    cmdclass={"build_ext": build_ext},
+)
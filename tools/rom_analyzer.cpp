@@ -0,0 +1,88 @@
+// Static analysis of a ROM: disassembles it by following control flow from the entry point and
+// the interrupt vectors and writes the map described in Rom_map.h.
+//
+// Build:  g++ -std=c++20 -O2 -I"../Gameboy emulator" rom_analyzer.cpp -o rom_analyzer   (needs nlohmann/json)
+// Usage:  ./rom_analyzer <rom> [--opcodes=<opcodes.json>] [--entry=<hex address>]... [--map=<file>] [--bitmap=<file>]
+//
+// --entry adds entry points to the defaults. The map goes to standard output unless --map is
+// given; --bitmap also writes the flags as one byte per ROM byte (bit 0 code, bit 1 block
+// start, bit 2 function). A summary goes to standard error.
+
+#include "Rom_analyzer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+    std::string rom_path;
+    std::string opcodes_path = "../Gameboy emulator/opcodes.json";
+    std::string map_path;
+    std::string bitmap_path;
+    std::vector<std::uint16_t> entries(Rom_analyzer::default_entries.begin(), Rom_analyzer::default_entries.end());
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], "--opcodes=", 10) == 0)
+            opcodes_path = argv[i] + 10;
+        else if (std::strncmp(argv[i], "--entry=", 8) == 0)
+            entries.push_back(static_cast<std::uint16_t>(std::strtoul(argv[i] + 8, nullptr, 16)));
+        else if (std::strncmp(argv[i], "--map=", 6) == 0)
+            map_path = argv[i] + 6;
+        else if (std::strncmp(argv[i], "--bitmap=", 9) == 0)
+            bitmap_path = argv[i] + 9;
+        else
+            rom_path = argv[i];
+    }
+    if (rom_path.empty())
+    {
+        std::cerr << "usage: rom_analyzer <rom> [--opcodes=<opcodes.json>] [--entry=<hex address>]... [--map=<file>] [--bitmap=<file>]\n";
+        return 2;
+    }
+
+    Opcode_table opcodes;
+    std::ifstream opcodes_file{ opcodes_path };
+    if (!opcodes.load(opcodes_file))
+    {
+        std::cerr << "Failed to read " << opcodes_path << '\n';
+        return 1;
+    }
+    std::ifstream rom_file{ rom_path, std::ios::binary };
+    if (!rom_file)
+    {
+        std::cerr << "Failed to load file\n";
+        return 1;
+    }
+    const std::vector<std::uint8_t> rom{ std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>() };
+
+    const Rom_map map = Rom_analyzer{ opcodes }.analyze(rom, entries);
+
+    if (map_path.empty())
+        map.write(std::cout);
+    else
+    {
+        std::ofstream out{ map_path };
+        map.write(out);
+    }
+    if (!bitmap_path.empty())
+    {
+        std::ofstream out{ bitmap_path, std::ios::binary };
+        out.write(reinterpret_cast<const char*>(map.flags.data()), static_cast<std::streamsize>(std::min(rom.size(), map.flags.size())));
+    }
+
+    std::size_t code_bytes = 0;
+    std::size_t functions = 0;
+    for (const auto flag : map.flags)
+    {
+        code_bytes += (flag & Rom_map::code) != 0;
+        functions += (flag & Rom_map::function) != 0;
+    }
+    std::cerr << code_bytes << " code bytes of " << std::min(rom.size(), Rom_map::size) << ", " << map.blocks.size() << " blocks, "
+        << functions << " functions, " << map.calls.size() << " call edges, " << map.indirect_jumps.size() << " indirect jumps\n";
+}
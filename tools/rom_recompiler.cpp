@@ -0,0 +1,371 @@
+// Ahead-of-time recompiler: translates every basic block of a ROM's code map into a C++
+// function that runs the block's instructions against a Cpu_state, and writes them out as a
+// source file to build into the emulator with the rest of it (see Compiled_rom.h).
+//
+// Build:  g++ -std=c++20 -O2 -I"../Gameboy emulator" rom_recompiler.cpp -o rom_recompiler   (needs nlohmann/json)
+// Usage:  ./rom_recompiler <rom> [--map=<file>] [--opcodes=<opcodes.json>] [--out=<file.cpp>] [--name=<symbol>]
+//
+// Without --map the ROM is analysed as rom_analyzer would with its default entry points. The
+// source goes to standard output unless --out is given and defines
+//   extern const Compiled_rom <symbol>;   (compiled_rom by default)
+// which the emulator picks up when built with -DGB_COMPILED_ROM=<symbol>, for example
+//   g++ -std=c++20 -O2 -DGB_COMPILED_ROM=compiled_rom "Gameboy emulator.cpp" game.cpp
+//
+// Loads, stores, register moves and unconditional jumps are written out with their operands
+// baked in; everything else calls the interpreter's handler for the opcode, so flags and
+// timing come from the same code either way. After each instruction the block checks
+// compiled_may_run and returns to the interpreter's loop whenever it would have done
+// something before the next fetch: an event, an interrupt, OAM DMA or a breakpoint. The
+// pairs that profiles show running back to back most (see fused_code) skip that check
+// between them when it is sure to pass.
+
+#include "Compiled_rom.h"
+#include "Rom_analyzer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace
+{
+    std::string hex(std::uint64_t value, int digits)
+    {
+        char text[24];
+        std::snprintf(text, sizeof text, "0x%0*llx", digits, static_cast<unsigned long long>(value));
+        return text;
+    }
+
+    // Operand order of the opcode table: B C D E H L (HL) A
+    std::string read_register(unsigned index)
+    {
+        static const char* const reads[]
+        {
+            "cpu.get_upper(cpu.registers.BC)", "cpu.get_lower(cpu.registers.BC)",
+            "cpu.get_upper(cpu.registers.DE)", "cpu.get_lower(cpu.registers.DE)",
+            "cpu.get_upper(cpu.registers.HL)", "cpu.get_lower(cpu.registers.HL)",
+            "cpu.read_from_memory(cpu.registers.HL)", "cpu.get_upper(cpu.registers.accumulator_and_flags)"
+        };
+        return reads[index];
+    }
+
+    std::string write_register(unsigned index, const std::string& value)
+    {
+        if (index == 6)
+            return "cpu.write_to_memory(cpu.registers.HL, " + value + ");";
+        static const char* const pairs[]{ "BC", "BC", "DE", "DE", "HL", "HL", "", "accumulator_and_flags" };
+        const std::string pair = std::string("cpu.registers.") + pairs[index];
+        const char* const half = index % 2 == 0 || index == 7 ? "set_upper" : "set_lower";
+        return pair + " = cpu." + half + "(" + pair + ", " + value + ");";
+    }
+
+    std::string handler(const std::string& group)
+    {
+        if (group == "x8/rsb")
+            return "x8_Rotate_and_Shift_Bits";
+        if (group == "x8/alu")
+            return "x8_Arithmetic_Logic_Unit";
+        if (group == "x8/lsm")
+            return "x8_Load_Store_Move";
+        if (group == "x16/lsm")
+            return "x16_Load_Store_Move";
+        if (group == "x16/alu")
+            return "x16_Arithmetic_Logic_Unit";
+        return "control";
+    }
+
+    struct Inline_code
+    {
+        std::string code;
+        bool uses_bus = false;  // so the program counter must be right while it runs
+        bool jumps = false;  // sets the program counter itself
+    };
+
+    // The instruction at address written out in full, or nothing if it is left to its handler.
+    std::optional<Inline_code> inline_code(std::span<const std::uint8_t> rom, std::uint16_t address)
+    {
+        const unsigned op = rom[address];
+        const unsigned d8 = address + 1u < rom.size() ? rom[address + 1] : 0;
+        const unsigned d16 = d8 | (address + 2u < rom.size() ? rom[address + 2] : 0) << 8;
+        static const char* const pairs[]{ "BC", "DE", "HL", "stack_pointer" };
+        const std::string pair = std::string("cpu.registers.") + pairs[op >> 4 & 3];
+        const std::string a = read_register(7);
+
+        if (op == 0x00)
+            return Inline_code{};
+        if (op >= 0x40 && op < 0x80 && op != 0x76)
+            return Inline_code{ write_register(op >> 3 & 7, read_register(op & 7)), (op & 7) == 6 || (op >> 3 & 7) == 6 };
+        if ((op & 0xC7) == 0x06)
+            return Inline_code{ write_register(op >> 3 & 7, hex(d8, 2)), (op >> 3 & 7) == 6 };
+        if ((op & 0xCF) == 0x01)
+            return Inline_code{ pair + " = " + hex(d16, 4) + ";" };
+        if ((op & 0xCF) == 0x03)
+            return Inline_code{ "++" + pair + ";" };
+        if ((op & 0xCF) == 0x0B)
+            return Inline_code{ "--" + pair + ";" };
+        switch (op)
+        {
+            case 0x02: return Inline_code{ "cpu.write_to_memory(cpu.registers.BC, " + a + ");", true };
+            case 0x12: return Inline_code{ "cpu.write_to_memory(cpu.registers.DE, " + a + ");", true };
+            case 0x22: return Inline_code{ "cpu.write_to_memory(cpu.registers.HL++, " + a + ");", true };
+            case 0x32: return Inline_code{ "cpu.write_to_memory(cpu.registers.HL--, " + a + ");", true };
+            case 0x0A: return Inline_code{ write_register(7, "cpu.read_from_memory(cpu.registers.BC)"), true };
+            case 0x1A: return Inline_code{ write_register(7, "cpu.read_from_memory(cpu.registers.DE)"), true };
+            case 0x2A: return Inline_code{ write_register(7, "cpu.read_from_memory(cpu.registers.HL++)"), true };
+            case 0x3A: return Inline_code{ write_register(7, "cpu.read_from_memory(cpu.registers.HL--)"), true };
+            case 0xE0: return Inline_code{ "cpu.write_to_memory(" + hex(0xFF00 + d8, 4) + ", " + a + ");", true };
+            case 0xF0: return Inline_code{ write_register(7, "cpu.read_from_memory(" + hex(0xFF00 + d8, 4) + ")"), true };
+            case 0xE2: return Inline_code{ "cpu.write_to_memory(0xff00 + " + read_register(1) + ", " + a + ");", true };
+            case 0xF2: return Inline_code{ write_register(7, "cpu.read_from_memory(0xff00 + " + read_register(1) + ")"), true };
+            case 0xEA: return Inline_code{ "cpu.write_to_memory(" + hex(d16, 4) + ", " + a + ");", true };
+            case 0xFA: return Inline_code{ write_register(7, "cpu.read_from_memory(" + hex(d16, 4) + ")"), true };
+            case 0xC3: return Inline_code{ "cpu.registers.program_counter = " + hex(d16, 4) + ";", false, true };
+            case 0x18: return Inline_code{ "cpu.registers.program_counter = " + hex(static_cast<std::uint16_t>(address + 2 + static_cast<std::int8_t>(d8)), 4) + ";", false, true };
+            case 0xE9: return Inline_code{ "cpu.registers.program_counter = cpu.registers.HL;", false, true };
+        }
+        return std::nullopt;
+    }
+
+    struct Fused_code
+    {
+        std::string guard;  // when the pair may run as one: what the check between them would find
+        std::string code;
+    };
+
+    // The conditional jump at address, once its operands are fetched and the program counter
+    // is past it.
+    std::string conditional_jump(std::span<const std::uint8_t> rom, std::uint16_t address)
+    {
+        const unsigned op = rom[address];
+        static const char* const conditions[]
+        {
+            "!cpu.is_flag_set(Flags::zero)", "cpu.is_flag_set(Flags::zero)",
+            "!cpu.is_flag_set(Flags::carry)", "cpu.is_flag_set(Flags::carry)"
+        };
+        const bool relative = op < 0x40;
+        const auto offset = static_cast<std::int8_t>(rom[address + 1]);
+        const unsigned target = relative ? static_cast<std::uint16_t>(address + 2 + offset) : rom[address + 1] | rom[address + 2] << 8;
+        std::string code = "if (" + std::string(conditions[op >> 3 & 3]) + ")\n{\n"
+            + "    cpu.registers.program_counter = " + hex(target, 4) + ";\n"
+            + "    cpu.cycles += 4 >> cpu.speed_shift;\n";
+        // As the handlers do: only JR Z and JR NZ back to a polling loop can be an idle loop
+        if (relative && op <= 0x28 && offset < 0)
+            code += "    cpu.skip_idle_loop(" + hex(address, 4) + ");\n";
+        return code + "}";
+    }
+
+    // Frequent pairs (see Profile::opcode_pairs) run as one instruction with a single check
+    // for the run loop, where the first cannot change what that check would find in between:
+    // a copy loop's LD A,(HL+) + LD (DE),A, a countdown's DEC r + JR NZ, and CP d8 + a
+    // conditional jump. Flags come from the same helpers as the handlers' and cycles add up
+    // the same.
+    std::optional<Fused_code> fused_code(std::span<const std::uint8_t> rom, std::uint16_t address, std::uint16_t second)
+    {
+        const unsigned first_op = rom[address];
+        const unsigned second_op = rom[second];
+        const unsigned next = second + (second_op >= 0xC0 ? 3 : second_op == 0x12 ? 1 : 2);
+        const std::string between = "cpu.cycles + (opcode_cycles[" + hex(first_op, 2) + "] >> cpu.speed_shift) < cpu.cycle_target && cpu.compiled_may_run(" + hex(second, 4) + ")";
+        const std::string skip = "cpu.registers.program_counter = " + hex(next, 4) + ";\n";
+        const bool conditional_jump_follows = (second_op & 0xE7) == 0x20 || (second_op & 0xE7) == 0xC2;
+
+        if (first_op == 0x2A && second_op == 0x12)
+            return Fused_code{ "cpu.read_pages[cpu.registers.HL >> 8] && " + between,
+                "const std::uint8_t value = cpu.read_pages[cpu.registers.HL >> 8][cpu.registers.HL & 0xFF];\n"
+                "++cpu.registers.HL;\n" + write_register(7, "value") + "\n" + skip
+                + "cpu.write_to_memory(cpu.registers.DE, value);" };
+        if ((first_op & 0xC7) == 0x05 && first_op != 0x35 && second_op == 0x20)
+        {
+            const std::string decrements[]
+            {
+                "cpu.registers.BC = cpu.decrement_upper(cpu.registers.BC);", "cpu.registers.BC = cpu.decrement_lower(cpu.registers.BC);",
+                "cpu.registers.DE = cpu.decrement_upper(cpu.registers.DE);", "cpu.registers.DE = cpu.decrement_lower(cpu.registers.DE);",
+                "cpu.registers.HL = cpu.decrement_upper(cpu.registers.HL);", "cpu.registers.HL = cpu.decrement_lower(cpu.registers.HL);",
+                "", "const auto a = cpu.decrement(cpu.get_upper(cpu.registers.accumulator_and_flags));\n" + write_register(7, "a")
+            };
+            return Fused_code{ between, decrements[first_op >> 3 & 7] + "\n" + skip + conditional_jump(rom, second) };
+        }
+        if (first_op == 0xFE && conditional_jump_follows)
+            return Fused_code{ between, "cpu.logically_compare_accumulator(" + hex(rom[address + 1], 2) + ");\n" + skip + conditional_jump(rom, second) };
+        return std::nullopt;
+    }
+
+    std::string indented(const std::string& code)
+    {
+        std::string result;
+        for (std::size_t begin = 0; begin < code.size();)
+        {
+            std::size_t end = code.find('\n', begin);
+            end = end == std::string::npos ? code.size() : end + 1;
+            result += (code[begin] == '\n' ? "" : "    ") + code.substr(begin, end - begin);
+            begin = end;
+        }
+        return result;
+    }
+
+    // The instruction at address and what follows it up to the next fetch, one line per
+    // statement and not indented.
+    std::string single(const Opcode_table& opcodes, std::span<const std::uint8_t> rom, std::uint16_t address, bool last)
+    {
+        const Opcode_info& info = opcodes.at(rom, address);
+        const std::uint16_t next = static_cast<std::uint16_t>(address + info.length);
+        const auto code = inline_code(rom, address);
+        std::string out = "// " + hex(address, 4) + ": " + info.mnemonic + (info.operands.empty() ? "" : " ") + info.operands + '\n';
+        if (!code || code->uses_bus)
+            out += "cpu.registers.program_counter = " + hex(code ? next : address + 1, 4) + ";\n";
+        out += "cpu.cycles += opcode_cycles[" + hex(rom[address], 2) + "] >> cpu.speed_shift;\n";
+        if (!code)
+            out += "cpu." + handler(opcodes.unprefixed[rom[address]].group) + "(opcode{ " + hex(rom[address], 2) + " });\n";
+        else if (!code->code.empty())
+            out += code->code + '\n';
+        const bool program_counter_set = !code || code->uses_bus || code->jumps;
+        if (!last)
+            out += "if (!cpu.compiled_may_run(" + hex(next, 4) + "))\n{\n"
+                + (program_counter_set ? "" : "    cpu.registers.program_counter = " + hex(next, 4) + ";\n") + "    return;\n}\n";
+        else if (!program_counter_set)
+            out += "cpu.registers.program_counter = " + hex(next, 4) + ";\n";
+        return out;
+    }
+
+    // Returns false, writing nothing, if the block does not decode to whole instructions of
+    // this ROM: a map made for another one.
+    bool write_block(std::ostream& out, const Opcode_table& opcodes, std::span<const std::uint8_t> rom, const Rom_map::Block& block)
+    {
+        std::vector<std::uint16_t> starts;
+        for (std::uint32_t address = block.start; address < block.end;)
+        {
+            const Opcode_info& info = opcodes.at(rom, address);
+            if (info.flow == Flow::illegal || info.length == 0)
+                return false;
+            starts.push_back(static_cast<std::uint16_t>(address));
+            address += info.length;
+            if (address > block.end || address > rom.size())
+                return false;
+        }
+
+        std::string body;
+        for (std::size_t i = 0; i < starts.size(); ++i)
+        {
+            const std::uint16_t address = starts[i];
+            const auto fused = i + 1 < starts.size() ? fused_code(rom, address, starts[i + 1]) : std::nullopt;
+            if (!fused)
+            {
+                body += single(opcodes, rom, address, i + 1 == starts.size());
+                continue;
+            }
+            // The unfused pair is the fallback for when the check between them would fail
+            const std::uint16_t second = starts[i + 1];
+            ++i;
+            const bool last = i + 1 == starts.size();
+            const std::uint16_t next = static_cast<std::uint16_t>(second + opcodes.at(rom, second).length);
+            body += "// " + hex(address, 4) + "-" + hex(second, 4).substr(2) + ", fused\n"
+                + "if (" + fused->guard + ")\n{\n"
+                + indented("cpu.cycles += (opcode_cycles[" + hex(rom[address], 2) + "] + opcode_cycles[" + hex(rom[second], 2) + "]) >> cpu.speed_shift;\n" + fused->code + "\n")
+                + "}\nelse\n{\n"
+                + indented(single(opcodes, rom, address, false) + single(opcodes, rom, second, true)) + "}\n";
+            if (!last)
+                body += "if (!cpu.compiled_may_run(" + hex(next, 4) + "))\n    return;\n";
+        }
+
+        out << "    void block_" << hex(block.start, 4).substr(2) << "(Cpu_state& cpu)\n    {\n";
+        std::string line;
+        for (std::size_t begin = 0; begin < body.size();)
+        {
+            const std::size_t end = body.find('\n', begin);
+            line = body.substr(begin, end - begin);
+            out << (line.empty() ? "" : "        ") << line << '\n';
+            begin = end + 1;
+        }
+        out << "    }\n\n";
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string rom_path;
+    std::string map_path;
+    std::string opcodes_path = "../Gameboy emulator/opcodes.json";
+    std::string out_path;
+    std::string name = "compiled_rom";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], "--map=", 6) == 0)
+            map_path = argv[i] + 6;
+        else if (std::strncmp(argv[i], "--opcodes=", 10) == 0)
+            opcodes_path = argv[i] + 10;
+        else if (std::strncmp(argv[i], "--out=", 6) == 0)
+            out_path = argv[i] + 6;
+        else if (std::strncmp(argv[i], "--name=", 7) == 0)
+            name = argv[i] + 7;
+        else
+            rom_path = argv[i];
+    }
+    if (rom_path.empty())
+    {
+        std::cerr << "usage: rom_recompiler <rom> [--map=<file>] [--opcodes=<opcodes.json>] [--out=<file.cpp>] [--name=<symbol>]\n";
+        return 2;
+    }
+
+    Opcode_table opcodes;
+    std::ifstream opcodes_file{ opcodes_path };
+    if (!opcodes.load(opcodes_file))
+    {
+        std::cerr << "Failed to read " << opcodes_path << '\n';
+        return 1;
+    }
+    std::ifstream rom_file{ rom_path, std::ios::binary };
+    if (!rom_file)
+    {
+        std::cerr << "Failed to load file\n";
+        return 1;
+    }
+    std::vector<std::uint8_t> rom{ std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>() };
+    rom.resize(std::min(rom.size(), Rom_map::size));
+
+    Rom_map map;
+    if (map_path.empty())
+        map = Rom_analyzer{ opcodes }.analyze(rom);
+    else
+    {
+        std::ifstream map_file{ map_path };
+        if (!map.read(map_file))
+        {
+            std::cerr << "Failed to read " << map_path << '\n';
+            return 1;
+        }
+    }
+
+    std::ofstream out_file;
+    if (!out_path.empty())
+        out_file.open(out_path);
+    std::ostream& out = out_path.empty() ? std::cout : out_file;
+
+    out << "// Generated by rom_recompiler from " << rom_path << "; do not edit.\n\n"
+        << "#include \"Compiled_rom.h\"\n#include \"Cpu_state.h\"\n\nnamespace\n{\n";
+    std::vector<const Rom_map::Block*> compiled;
+    std::size_t skipped = 0;
+    for (const auto& block : map.blocks)
+    {
+        if (write_block(out, opcodes, rom, block))
+            compiled.push_back(&block);
+        else
+            ++skipped;
+    }
+    out << "    constexpr Compiled_block blocks[]\n    {\n";
+    for (const auto* block : compiled)
+        out << "        { " << hex(block->start, 4) << ", " << hex(block->end, 4) << ", block_" << hex(block->start, 4).substr(2) << " },\n";
+    if (compiled.empty())
+        out << "        {}\n";
+    out << "    };\n}\n\n"
+        << "extern const Compiled_rom " << name << "{ " << hex(Compiled_rom::hash(rom), 16) << ", { blocks, " << compiled.size() << " } };\n";
+
+    std::cerr << compiled.size() << " blocks compiled";
+    if (skipped != 0)
+        std::cerr << ", " << skipped << " skipped that do not decode in this ROM";
+    std::cerr << '\n';
+}